@@ -404,7 +404,9 @@ LUA_API lua_Number lua_tonumber (lua_State *L, int idx) {
 LUA_API lua_Integer lua_tointeger (lua_State *L, int idx) {
   TValue n;
   const TValue *o = index2adr(L, idx);
-  if (tonumber(o, &n)) {
+  if (ttisint(o))
+    return ivalue(o);
+  else if (tonumber(o, &n)) {
     lua_Integer res;
     lua_Number num = nvalue(o);
     lua_number2integer(res, num);
@@ -435,6 +437,11 @@ LUA_API const char *lua_tolstring (lua_State *L, int idx, size_t *len) {
     lua_unlock(L);
   }
   if (len != NULL) *len = tsvalue(o)->len;
+  if (tsvalue(o)->kind == LSTRBUF) {  /* may need a '\0' of its own */
+    lua_lock(L);
+    luaS_seal(L, rawtsvalue(o));
+    lua_unlock(L);
+  }
   return svalue(o);
 }
 
@@ -530,7 +537,12 @@ LUA_API void lua_pushinteger (lua_State *L, lua_Integer n) {
    * L->top->value.n = cast_num(n)
    * L->top->tt = LUA_TNUMBER       LUA_TNUMBER 就是一个数字，标志变量类型的
    */
-  setnvalue(L->top, cast_num(n));
+  if (cast(lua_Integer, cast(l_int, n)) == n) {
+    setivalue(L->top, cast(l_int, n));
+  }
+  else {
+    setnvalue(L->top, cast_num(n));
+  }
   api_incr_top(L);
   lua_unlock(L);
 }
@@ -1019,7 +1031,77 @@ LUA_API int lua_load (lua_State *L, lua_Reader reader, void *data,
   lua_lock(L);
   if (!chunkname) chunkname = "?";
   luaZ_init(L, &z, reader, data);
-  status = luaD_protectedparser(L, &z, chunkname);
+  status = luaD_protectedparser(L, &z, chunkname, NULL);
+  lua_unlock(L);
+  return status;
+}
+
+
+struct LoadB {
+  const char *s;
+  size_t size;
+};
+
+
+static const char *getblock (lua_State *L, void *ud, size_t *size) {
+  struct LoadB *lb = cast(struct LoadB *, ud);
+  UNUSED(L);
+  if (lb->size == 0) return NULL;
+  *size = lb->size;
+  lb->size = 0;
+  return lb->s;
+}
+
+
+struct NewMapS {  /* data to `f_newmapping' */
+  void *block;
+  size_t size;
+  lua_Release release;
+  void *ud;
+  Mapping *m;
+};
+
+
+static void f_newmapping (lua_State *L, void *ud) {
+  struct NewMapS *n = cast(struct NewMapS *, ud);
+  n->m = luaF_newmapping(L, n->block, n->size, n->release, n->ud);
+}
+
+
+/*
+** load a chunk held in `block', which must not change while in use.
+** The functions of a chunk dumped in the mapped format use its code
+** and line information in place, and `release' is called when the
+** last of them is collected; otherwise it is called before returning.
+** `release' may be NULL
+*/
+LUA_API int lua_loadblock (lua_State *L, void *block, size_t size,
+                           const char *chunkname, lua_Release release,
+                           void *ud) {
+  ZIO z;
+  struct LoadB lb;
+  struct NewMapS n;
+  int status;
+  lua_lock(L);
+  if (!chunkname) chunkname = "?";
+  lb.s = cast(const char *, block);
+  lb.size = size;
+  luaZ_init(L, &z, getblock, &lb);
+  n.block = block; n.size = size; n.release = release; n.ud = ud;
+  n.m = NULL;
+  if (cast(size_t, block) % LUAC_ALIGN == 0) {  /* else copy everything */
+    status = luaD_pcall(L, f_newmapping, &n, savestack(L, L->top),
+                        L->errfunc);
+    if (status != 0) {  /* no memory for the mapping? */
+      if (release) (*release)(ud, block, size);
+      lua_unlock(L);
+      return status;
+    }
+    G(L)->hasmaps = 1;
+  }
+  status = luaD_protectedparser(L, &z, chunkname, n.m);
+  if (n.m != NULL) luaF_unmap(L, n.m);  /* drop the reference of the loader */
+  else if (release) (*release)(ud, block, size);
   lua_unlock(L);
   return status;
 }
@@ -1032,7 +1114,7 @@ LUA_API int lua_dump (lua_State *L, lua_Writer writer, void *data) {
   api_checknelems(L, 1);
   o = L->top - 1;
   if (isLfunction(o))
-    status = luaU_dump(L, clvalue(o)->l.p, writer, data, 0);
+    status = luaU_dump(L, clvalue(o)->l.p, writer, data, 0, LUAC_FORMAT);
   else
     status = 1;
   lua_unlock(L);
@@ -1104,7 +1186,8 @@ LUA_API int lua_gc (lua_State *L, int what, int data) {
         g->GCthreshold = 0;
       while (g->GCthreshold <= g->totalbytes)
         luaC_step(L);
-      if (g->gcstate == GCSpause)  /* end of cycle? */
+      /* end of cycle? (in generational mode, each step is a whole cycle) */
+      if (g->gcstate == GCSpause || g->gckind == KGC_GEN)
         res = 1;  /* signal it */
       break;
     }
@@ -1118,6 +1201,21 @@ LUA_API int lua_gc (lua_State *L, int what, int data) {
       g->gcstepmul = data;
       break;
     }
+    case LUA_GCGEN:
+    case LUA_GCINC: {
+      res = (g->gckind == KGC_GEN) ? LUA_GCGEN : LUA_GCINC;  /* previous mode */
+      luaC_changemode(L, (what == LUA_GCGEN) ? KGC_GEN : KGC_NORMAL);
+      break;
+    }
+    case LUA_GCBULKFREE: {
+      if (data != 0 && (*g->frealloc)(g->ud, NULL, LUA_GCBULKFREE, 0) == NULL)
+        res = -1;  /* allocator would not release everything */
+      else {
+        res = g->bulkfree;
+        g->bulkfree = cast_byte(data != 0);
+      }
+      break;
+    }
     default: res = -1;  /* invalid option */
   }
   lua_unlock(L);
@@ -1201,6 +1299,22 @@ LUA_API void lua_setallocf (lua_State *L, lua_Alloc f, void *ud) {
 }
 
 
+/*
+** (re)allocate a block that a library owns, with the allocation function
+** of the state, counting it in the memory that paces the collector (but
+** not running it, so no finalizer can touch the block meanwhile); raises
+** a memory error on failure
+*/
+LUA_API void *lua_realloc (lua_State *L, void *ptr, size_t osize,
+                           size_t nsize) {
+  void *p;
+  lua_lock(L);
+  p = luaM_realloc_(L, ptr, osize, nsize);
+  lua_unlock(L);
+  return p;
+}
+
+
 /*
  * 这个函数分配分配一块指定大小的内存块，
  * 把内存块地址作为一个完整的 userdata 压入堆栈，并返回这个地址。
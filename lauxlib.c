@@ -12,6 +12,10 @@
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(LUA_SLABALLOC) && defined(LUA_BGSWEEP)
+#include <pthread.h>
+#endif
+
 
 /* This file uses only the official API of Lua.
 ** Any function declared here could be written as an application function.
@@ -386,53 +390,84 @@ LUALIB_API const char *luaL_findtable (lua_State *L, int idx,
 */
 
 
-#define bufflen(B)	((B)->p - (B)->buffer)
-#define bufffree(B)	((size_t)(LUAL_BUFFERSIZE - bufflen(B)))
+#define bufflen(B)	((size_t)((B)->p - (B)->b))
+#define bufffree(B)	((B)->size - bufflen(B))
 
-#define LIMIT	(LUA_MINSTACK/2)
+#define buffonstack(B)	((B)->b != (B)->buffer)
 
 
-static int emptybuffer (luaL_Buffer *B) {
-  size_t l = bufflen(B);
-  if (l == 0) return 0;  /* put nothing on stack */
-  else {
-    lua_pushlstring(B->L, B->buffer, l);
-    B->p = B->buffer;
-    B->lvl++;
-    return 1;
-  }
+/*
+** A box is a userdata on the stack that owns a block from the state's
+** allocator, so that the block is released (by `__gc') even if an
+** error interrupts the use of the buffer.
+*/
+typedef struct UBox {
+  void *box;
+  size_t bsize;
+} UBox;
+
+
+static void *resizebox (lua_State *L, int idx, size_t newsize) {
+  void *ud;
+  lua_Alloc allocf = lua_getallocf(L, &ud);
+  UBox *box = (UBox *)lua_touserdata(L, idx);
+  void *temp = allocf(ud, box->box, box->bsize, newsize);
+  if (temp == NULL && newsize > 0)
+    luaL_error(L, "not enough memory for buffer allocation");
+  box->box = temp;
+  box->bsize = newsize;
+  return temp;
 }
 
 
-static void adjuststack (luaL_Buffer *B) {
-  if (B->lvl > 1) {
-    lua_State *L = B->L;
-    int toget = 1;  /* number of levels to concat */
-    size_t toplen = lua_strlen(L, -1);
-    do {
-      size_t l = lua_strlen(L, -(toget+1));
-      if (B->lvl - toget + 1 >= LIMIT || toplen > l) {
-        toplen += l;
-        toget++;
-      }
-      else break;
-    } while (toget < B->lvl);
-    lua_concat(L, toget);
-    B->lvl = B->lvl - toget + 1;
+static int boxgc (lua_State *L) {
+  resizebox(L, 1, 0);
+  return 0;
+}
+
+
+static void *newbox (lua_State *L, size_t newsize) {
+  UBox *box = (UBox *)lua_newuserdata(L, sizeof(UBox));
+  box->box = NULL;
+  box->bsize = 0;
+  if (luaL_newmetatable(L, "_UBOX*")) {  /* creating metatable? */
+    lua_pushcfunction(L, boxgc);
+    lua_setfield(L, -2, "__gc");
   }
+  lua_setmetatable(L, -2);
+  return resizebox(L, -1, newsize);
 }
 
 
-LUALIB_API char *luaL_prepbuffer (luaL_Buffer *B) {
-  if (emptybuffer(B))
-    adjuststack(B);
-  return B->buffer;
+/* make room for `sz' more bytes, growing the box geometrically */
+LUALIB_API char *luaL_prepbuffsize (luaL_Buffer *B, size_t sz) {
+  if (bufffree(B) < sz) {
+    lua_State *L = B->L;
+    size_t l = bufflen(B);
+    size_t newsize = B->size * 2;  /* double buffer size */
+    char *newbuff;
+    if (newsize - l < sz)  /* not big enough? */
+      newsize = l + sz;
+    if (newsize < l || newsize - l < sz)
+      luaL_error(L, "buffer too large");
+    if (buffonstack(B))  /* box is on the top of the stack */
+      newbuff = (char *)resizebox(L, -1, newsize);
+    else {  /* no box yet */
+      newbuff = (char *)newbox(L, newsize);
+      memcpy(newbuff, B->b, l);  /* copy original contents */
+    }
+    B->b = newbuff;
+    B->size = newsize;
+    B->p = newbuff + l;
+  }
+  return B->p;
 }
 
 
 LUALIB_API void luaL_addlstring (luaL_Buffer *B, const char *s, size_t l) {
-  while (l--)
-    luaL_addchar(B, *s++);
+  char *p = (l <= bufffree(B)) ? B->p : luaL_prepbuffsize(B, l);
+  memcpy(p, s, l);
+  B->p = p + l;
 }
 
 
@@ -442,9 +477,12 @@ LUALIB_API void luaL_addstring (luaL_Buffer *B, const char *s) {
 
 
 LUALIB_API void luaL_pushresult (luaL_Buffer *B) {
-  emptybuffer(B);
-  lua_concat(B->L, B->lvl);
-  B->lvl = 1;
+  lua_State *L = B->L;
+  lua_pushlstring(L, B->b, bufflen(B));
+  if (buffonstack(B)) {
+    resizebox(L, -2, 0);  /* release its memory now */
+    lua_remove(L, -2);  /* remove box */
+  }
 }
 
 
@@ -458,18 +496,18 @@ LUALIB_API void luaL_addvalue (luaL_Buffer *B) {
     lua_pop(L, 1);  /* remove from stack */
   }
   else {
-    if (emptybuffer(B))
-      lua_insert(L, -2);  /* put buffer before new value */
-    B->lvl++;  /* add new value into B stack */
-    adjuststack(B);
+    if (buffonstack(B))
+      lua_insert(L, -2);  /* put value below box */
+    luaL_addlstring(B, s, vl);
+    lua_remove(L, buffonstack(B) ? -2 : -1);  /* remove value */
   }
 }
 
 
 LUALIB_API void luaL_buffinit (lua_State *L, luaL_Buffer *B) {
   B->L = L;
-  B->p = B->buffer;
-  B->lvl = 0;
+  B->p = B->b = B->buffer;
+  B->size = LUAL_BUFFERSIZE;
 }
 
 /* }====================================================== */
@@ -546,6 +584,16 @@ static int errfile (lua_State *L, const char *what, int fnameindex) {
 }
 
 
+#if defined(lua_mapfile)
+
+static void unmapfile (void *ud, void *block, size_t size) {
+  (void)ud;
+  lua_unmapfile(block, size);
+}
+
+#endif
+
+
 LUALIB_API int luaL_loadfile (lua_State *L, const char *filename) {
   LoadF lf;
   int status, readstatus;
@@ -574,6 +622,19 @@ LUALIB_API int luaL_loadfile (lua_State *L, const char *filename) {
     /* skip eventual `#!...' */
    while ((c = getc(lf.f)) != EOF && c != LUA_SIGNATURE[0]) ;
     lf.extraline = 0;
+#if defined(lua_mapfile)
+    if (ftell(lf.f) == 1) {  /* chunk starts the file? map it */
+      void *b;
+      size_t sz = 0;
+      lua_mapfile(lf.f, b, sz);
+      if (b != NULL) {
+        fclose(lf.f);
+        status = lua_loadblock(L, b, sz, lua_tostring(L, -1), unmapfile, NULL);
+        lua_remove(L, fnameindex);
+        return status;
+      }
+    }
+#endif
   }
   ungetc(c, lf.f);
   status = lua_load(L, getF, &lf, lua_tostring(L, -1));
@@ -634,6 +695,223 @@ static void *l_alloc (void *ud, void *ptr, size_t osize, size_t nsize) {
 }
 
 
+#if defined(LUA_SLABALLOC)
+
+/*
+** {======================================================
+** Slab allocator
+** =======================================================
+*/
+
+/*
+** Blocks of up to SLABMAX bytes are rounded up to a multiple of
+** SLABGRAIN and carved from SLABSIZE-byte slabs, which hold blocks of
+** a single size class; freed blocks go to the free list of their
+** class. Larger blocks go to `l_alloc', with a header linking them in
+** a list. When the state itself is freed, by `lua_close', everything
+** is released at once, so the collector does not free the objects
+** one by one (see LUA_GCBULKFREE); finalizers still run before that.
+*/
+
+#define SLABGRAIN	8
+#define SLABMAX		256
+#define SLABSIZE	(16*1024)
+#define NCLASSES	(SLABMAX/SLABGRAIN)
+
+#define sizeclass(s)	(((s) + SLABGRAIN - 1) / SLABGRAIN - 1)
+#define classsize(c)	(((size_t)(c) + 1) * SLABGRAIN)
+
+typedef union Slab {
+  union Slab *next;
+  LUAI_USER_ALIGNMENT_T u;  /* blocks after the header are aligned */
+} Slab;
+
+typedef union Big {
+  struct { union Big *prev, *next; } l;
+  LUAI_USER_ALIGNMENT_T u;
+} Big;
+
+typedef struct SlabAlloc {
+  void *freelist[NCLASSES];
+  char *top[NCLASSES];  /* free space of the current slab of each class */
+  char *limit[NCLASSES];
+  Slab *slabs;  /* all slabs */
+  Big bigs;  /* head of the (circular) list of larger blocks */
+  void *state;  /* first block, holding the state */
+  int opening;  /* state is being created; do not release yet */
+  luaL_SlabStats st;
+#if defined(LUA_BGSWEEP)
+  pthread_mutex_t lock;  /* the collector may free from another thread */
+#endif
+} SlabAlloc;
+
+#if defined(LUA_BGSWEEP)
+#define slablock(a)	pthread_mutex_lock(&(a)->lock)
+#define slabunlock(a)	pthread_mutex_unlock(&(a)->lock)
+#else
+#define slablock(a)	((void)0)
+#define slabunlock(a)	((void)0)
+#endif
+
+
+static void linkbig (SlabAlloc *a, Big *h) {
+  h->l.prev = &a->bigs;
+  h->l.next = a->bigs.l.next;
+  h->l.next->l.prev = h;
+  a->bigs.l.next = h;
+}
+
+
+static void unlinkbig (Big *h) {
+  h->l.prev->l.next = h->l.next;
+  h->l.next->l.prev = h->l.prev;
+}
+
+
+static void *slabget (SlabAlloc *a, size_t size) {
+  int c;
+  void **b;
+  if (size > SLABMAX) {
+    Big *h = (Big *)l_alloc(NULL, NULL, 0, sizeof(Big) + size);
+    if (h == NULL) return NULL;
+    linkbig(a, h);
+    a->st.large += size;
+    return h + 1;
+  }
+  c = sizeclass(size);
+  b = (void **)a->freelist[c];
+  if (b != NULL) {
+    a->freelist[c] = *b;
+    a->st.hits++;
+  }
+  else {
+    if ((size_t)(a->limit[c] - a->top[c]) < classsize(c)) {  /* full? */
+      Slab *s = (Slab *)malloc(SLABSIZE);
+      if (s == NULL) return NULL;
+      s->next = a->slabs;
+      a->slabs = s;
+      a->top[c] = (char *)(s + 1);
+      a->limit[c] = (char *)s + SLABSIZE;
+      a->st.reserved += SLABSIZE;
+    }
+    b = (void **)a->top[c];
+    a->top[c] += classsize(c);
+    a->st.carved++;
+  }
+  a->st.small += classsize(c);
+  return b;
+}
+
+
+static void slabput (SlabAlloc *a, void *ptr, size_t size) {
+  if (ptr == NULL) return;
+  if (size > SLABMAX) {
+    Big *h = (Big *)ptr - 1;
+    unlinkbig(h);
+    l_alloc(NULL, h, sizeof(Big) + size, 0);
+    a->st.large -= size;
+  }
+  else {
+    int c = sizeclass(size);
+    *(void **)ptr = a->freelist[c];
+    a->freelist[c] = ptr;
+    a->st.small -= classsize(c);
+  }
+}
+
+
+static void slabrelease (SlabAlloc *a) {
+  while (a->bigs.l.next != &a->bigs) {
+    Big *h = a->bigs.l.next;
+    unlinkbig(h);
+    free(h);
+  }
+  while (a->slabs != NULL) {
+    Slab *s = a->slabs;
+    a->slabs = s->next;
+    free(s);
+  }
+#if defined(LUA_BGSWEEP)
+  pthread_mutex_destroy(&a->lock);
+#endif
+  free(a);
+}
+
+
+static void *slab_alloc (void *ud, void *ptr, size_t osize, size_t nsize) {
+  SlabAlloc *a = (SlabAlloc *)ud;
+  void *nptr;
+  slablock(a);
+  if (nsize == 0) {
+    if (ptr == NULL && osize == LUA_GCBULKFREE) {  /* asked by `lua_gc'? */
+      slabunlock(a);
+      return a;  /* yes: freeing the state releases everything */
+    }
+    if (ptr == a->state && !a->opening) {  /* state closed? */
+      slabunlock(a);
+      slabrelease(a);
+      return NULL;
+    }
+    slabput(a, ptr, osize);
+    nptr = NULL;
+  }
+  else if (osize > SLABMAX && nsize > SLABMAX) {
+    Big *h = (Big *)ptr - 1;
+    unlinkbig(h);
+    h = (Big *)l_alloc(NULL, h, sizeof(Big) + osize, sizeof(Big) + nsize);
+    if (h == NULL) {
+      linkbig(a, (Big *)ptr - 1);
+      nptr = NULL;
+    }
+    else {
+      linkbig(a, h);
+      a->st.large = a->st.large - osize + nsize;
+      nptr = h + 1;
+    }
+  }
+  else if (osize > 0 && osize <= SLABMAX && nsize <= SLABMAX &&
+           sizeclass(osize) == sizeclass(nsize))
+    nptr = ptr;  /* block already fits */
+  else {
+    nptr = slabget(a, nsize);
+    if (nptr != NULL) {
+      if (osize > 0) memcpy(nptr, ptr, (osize < nsize) ? osize : nsize);
+      slabput(a, ptr, osize);
+    }
+    else if (nsize < osize) {  /* shrinking cannot fail... */
+      nptr = ptr;  /* ...so keep the block as a small one of `nsize' */
+      a->st.small += classsize(sizeclass(nsize));
+      if (osize > SLABMAX) {  /* hand the large block over to the slabs */
+        Slab *s = (Slab *)((Big *)ptr - 1);
+        unlinkbig((Big *)s);
+        s->next = a->slabs;
+        a->slabs = s;
+        a->st.large -= osize;
+        a->st.reserved += sizeof(Big) + osize;
+      }
+      else a->st.small -= classsize(sizeclass(osize));
+    }
+  }
+  if (a->state == NULL) a->state = nptr;
+  slabunlock(a);
+  return nptr;
+}
+
+
+LUALIB_API int luaL_slabstats (lua_State *L, luaL_SlabStats *st) {
+  void *ud;
+  if (lua_getallocf(L, &ud) != slab_alloc) return 0;
+  slablock((SlabAlloc *)ud);
+  *st = ((SlabAlloc *)ud)->st;
+  slabunlock((SlabAlloc *)ud);
+  return 1;
+}
+
+/* }====================================================== */
+
+#endif
+
+
 static int panic (lua_State *L) {
   (void)L;  /* to avoid warnings */
   fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n",
@@ -642,9 +920,35 @@ static int panic (lua_State *L) {
 }
 
 
+#if defined(LUA_SLABALLOC)
+
+LUALIB_API lua_State *luaL_newstate (void) {
+  lua_State *L;
+  SlabAlloc *a = (SlabAlloc *)calloc(1, sizeof(SlabAlloc));
+  if (a == NULL) return NULL;
+#if defined(LUA_BGSWEEP)
+  pthread_mutex_init(&a->lock, NULL);
+#endif
+  a->bigs.l.prev = a->bigs.l.next = &a->bigs;
+  a->opening = 1;
+  L = lua_newstate(slab_alloc, a);
+  a->opening = 0;  /* from now on, freeing the state releases `a' */
+  if (L == NULL) {
+    slabrelease(a);
+    return NULL;
+  }
+  lua_atpanic(L, &panic);
+  lua_gc(L, LUA_GCBULKFREE, 1);
+  return L;
+}
+
+#else
+
 LUALIB_API lua_State *luaL_newstate (void) {
   lua_State *L = lua_newstate(l_alloc, NULL);
   if (L) lua_atpanic(L, &panic);
   return L;
 }
 
+#endif
+
@@ -81,6 +81,18 @@ LUALIB_API int (luaL_loadstring) (lua_State *L, const char *s);
 
 LUALIB_API lua_State *(luaL_newstate) (void);
 
+#if defined(LUA_SLABALLOC)
+typedef struct luaL_SlabStats {
+  size_t reserved;  /* bytes held in slabs */
+  size_t small;  /* bytes of slab blocks in use (rounded to their class) */
+  size_t large;  /* bytes of larger blocks in use */
+  unsigned long hits;  /* slab blocks taken from a free list */
+  unsigned long carved;  /* slab blocks taken from fresh slab space */
+} luaL_SlabStats;
+
+LUALIB_API int (luaL_slabstats) (lua_State *L, luaL_SlabStats *st);
+#endif
+
 
 LUALIB_API const char *(luaL_gsub) (lua_State *L, const char *s, const char *p,
                                                   const char *r);
@@ -124,15 +136,21 @@ LUALIB_API const char *(luaL_findtable) (lua_State *L, int idx,
 
 
 
+/*
+** Contents go to `buffer' and, once they outgrow it, to a userdata
+** that doubles in size as needed and stays on the top of the stack
+** while the buffer is in use.
+*/
 typedef struct luaL_Buffer {
   char *p;			/* current position in buffer */
-  int lvl;  /* number of strings in the stack (level) */
+  char *b;  /* start of buffer (`buffer' or a userdata) */
+  size_t size;  /* size of `b' */
   lua_State *L;
   char buffer[LUAL_BUFFERSIZE];
 } luaL_Buffer;
 
 #define luaL_addchar(B,c) \
-  ((void)((B)->p < ((B)->buffer+LUAL_BUFFERSIZE) || luaL_prepbuffer(B)), \
+  ((void)((B)->p < ((B)->b+(B)->size) || luaL_prepbuffsize(B, 1)), \
    (*(B)->p++ = (char)(c)))
 
 /* compatibility only */
@@ -140,8 +158,10 @@ typedef struct luaL_Buffer {
 
 #define luaL_addsize(B,n)	((B)->p += (n))
 
+#define luaL_prepbuffer(B)	luaL_prepbuffsize(B, LUAL_BUFFERSIZE)
+
 LUALIB_API void (luaL_buffinit) (lua_State *L, luaL_Buffer *B);
-LUALIB_API char *(luaL_prepbuffer) (luaL_Buffer *B);
+LUALIB_API char *(luaL_prepbuffsize) (luaL_Buffer *B, size_t sz);
 LUALIB_API void (luaL_addlstring) (luaL_Buffer *B, const char *s, size_t l);
 LUALIB_API void (luaL_addstring) (luaL_Buffer *B, const char *s);
 LUALIB_API void (luaL_addvalue) (luaL_Buffer *B);
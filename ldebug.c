@@ -51,7 +51,9 @@ static int currentline (lua_State *L, CallInfo *ci) {
 
 
 /*
-** this function can be called asynchronous (e.g. during a signal)
+** this function can be called asynchronous (e.g. during a signal).
+** Running interpreters switch between their hooked and unhooked
+** variants when they next call, return or jump (see `updatehook').
 */
 LUA_API int lua_sethook (lua_State *L, lua_Hook func, int mask, int count) {
   if (func == NULL || mask == 0) {  /* turn off hooks? */
@@ -21,6 +21,8 @@ typedef struct {
  void* data;
  int strip;
  int status;
+ int format;
+ size_t pos;				/* bytes written so far */
 } DumpState;
 
 #define DumpMem(b,n,size,D)	DumpBlock(b,(n)*(size),D)
@@ -34,6 +36,14 @@ static void DumpBlock(const void* b, size_t size, DumpState* D)
   D->status=(*D->writer)(D->L,b,size,D->data);
   lua_lock(D->L);
  }
+ D->pos+=size;
+}
+
+static void DumpAlign(DumpState* D)
+{
+ static const char zeros[LUAC_ALIGN]={0};
+ if (D->format==LUAC_MAPFORMAT && D->pos%LUAC_ALIGN!=0)
+  DumpBlock(zeros,LUAC_ALIGN-D->pos%LUAC_ALIGN,D);
 }
 
 static void DumpChar(int y, DumpState* D)
@@ -55,6 +65,7 @@ static void DumpNumber(lua_Number x, DumpState* D)
 static void DumpVector(const void* b, int n, size_t size, DumpState* D)
 {
  DumpInt(n,D);
+ DumpAlign(D);
  DumpMem(b,n,size,D);
 }
 
@@ -93,6 +104,7 @@ static void DumpConstants(const Proto* f, DumpState* D)
 	DumpChar(bvalue(o),D);
 	break;
    case LUA_TNUMBER:
+	DumpAlign(D);
 	DumpNumber(nvalue(o),D);
 	break;
    case LUA_TSTRING:
@@ -143,14 +155,14 @@ static void DumpFunction(const Proto* f, const TString* p, DumpState* D)
 static void DumpHeader(DumpState* D)
 {
  char h[LUAC_HEADERSIZE];
- luaU_header(h);
+ luaU_header(h,D->format);
  DumpBlock(h,LUAC_HEADERSIZE,D);
 }
 
 /*
 ** dump Lua function as precompiled chunk
 */
-int luaU_dump (lua_State* L, const Proto* f, lua_Writer w, void* data, int strip)
+int luaU_dump (lua_State* L, const Proto* f, lua_Writer w, void* data, int strip, int format)
 {
  DumpState D;
  D.L=L;
@@ -158,6 +170,8 @@ int luaU_dump (lua_State* L, const Proto* f, lua_Writer w, void* data, int strip
  D.data=data;
  D.strip=strip;
  D.status=0;
+ D.format=format;
+ D.pos=0;
  DumpHeader(&D);
  DumpFunction(f,NULL,&D);
  return D.status;
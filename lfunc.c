@@ -121,6 +121,8 @@ Proto *luaF_newproto (lua_State *L) {
   f->sizep = 0;
   f->code = NULL;
   f->sizecode = 0;
+  f->cache = NULL;
+  f->sizecache = 0;
   f->sizelineinfo = 0;
   f->sizeupvalues = 0;
   f->nups = 0;
@@ -134,15 +136,59 @@ Proto *luaF_newproto (lua_State *L) {
   f->linedefined = 0;
   f->lastlinedefined = 0;
   f->source = NULL;
+  f->map = NULL;
   return f;
 }
 
 
+/*
+** create the (empty) inline caches for the code of `f'
+*/
+void luaF_initcache (lua_State *L, Proto *f) {
+  int i;
+  luaM_reallocvector(L, f->cache, f->sizecache, f->sizecode, int);
+  f->sizecache = f->sizecode;
+  for (i=0; i<f->sizecache; i++) f->cache[i] = 0;
+}
+
+
+/*
+** a new block for `lua_loadblock', referenced only by the loader
+*/
+Mapping *luaF_newmapping (lua_State *L, void *block, size_t size,
+                          lua_Release release, void *ud) {
+  Mapping *m = luaM_new(L, Mapping);
+  m->block = block;
+  m->size = size;
+  m->release = release;
+  m->ud = ud;
+  m->nref = 1;
+  return m;
+}
+
+
+/*
+** drop a reference to a block; the last one releases it (this may run
+** in the thread of LUA_BGSWEEP, which frees dead prototypes)
+*/
+void luaF_unmap (lua_State *L, Mapping *m) {
+  if (--m->nref == 0) {
+    if (m->release) (*m->release)(m->ud, m->block, m->size);
+    luaM_free(L, m);
+  }
+}
+
+
 void luaF_freeproto (lua_State *L, Proto *f) {
-  luaM_freearray(L, f->code, f->sizecode, Instruction);
+  if (f->map != NULL)  /* `code' and `lineinfo' are in a block? */
+    luaF_unmap(L, f->map);
+  else {
+    luaM_freearray(L, f->code, f->sizecode, Instruction);
+    luaM_freearray(L, f->lineinfo, f->sizelineinfo, int);
+  }
+  luaM_freearray(L, f->cache, f->sizecache, int);
   luaM_freearray(L, f->p, f->sizep, Proto *);
   luaM_freearray(L, f->k, f->sizek, TValue);
-  luaM_freearray(L, f->lineinfo, f->sizelineinfo, int);
   luaM_freearray(L, f->locvars, f->sizelocvars, struct LocVar);
   luaM_freearray(L, f->upvalues, f->sizeupvalues, TString *);
   luaM_free(L, f);
@@ -24,6 +24,10 @@ LUAI_FUNC Closure *luaF_newLclosure (lua_State *L, int nelems, Table *e);
 LUAI_FUNC UpVal *luaF_newupval (lua_State *L);
 LUAI_FUNC UpVal *luaF_findupval (lua_State *L, StkId level);
 LUAI_FUNC void luaF_close (lua_State *L, StkId level);
+LUAI_FUNC void luaF_initcache (lua_State *L, Proto *f);
+LUAI_FUNC Mapping *luaF_newmapping (lua_State *L, void *block, size_t size,
+                                    lua_Release release, void *ud);
+LUAI_FUNC void luaF_unmap (lua_State *L, Mapping *m);
 LUAI_FUNC void luaF_freeproto (lua_State *L, Proto *f);
 LUAI_FUNC void luaF_freeclosure (lua_State *L, Closure *c);
 LUAI_FUNC void luaF_freeupval (lua_State *L, UpVal *uv);
@@ -6,6 +6,14 @@
 
 #include <string.h>
 
+#if defined(LUA_BGSWEEP) || defined(LUA_PARMARK)
+#include <pthread.h>
+#endif
+
+#if defined(LUA_PARMARK)
+#include <unistd.h>
+#endif
+
 #define lgc_c
 #define LUA_CORE
 
@@ -27,9 +35,11 @@
 #define GCSWEEPMAX	40
 #define GCSWEEPCOST	10
 #define GCFINALIZECOST	100
+#define GCREHASHMAX	40
+#define GCREHASHDIV	32  /* each step also moves 1/GCREHASHDIV of the lists */
 
 
-#define maskmarks	cast_byte(~(bitmask(BLACKBIT)|WHITEBITS))
+#define maskmarks	cast_byte(~(bitmask(BLACKBIT)|WHITEBITS|bitmask(OLDBIT)))
 
 #define makewhite(g,x)	\
    ((x)->gch.marked = cast_byte(((x)->gch.marked & maskmarks) | luaC_white(g)))
@@ -39,6 +49,15 @@
 
 #define stringmark(s)	reset2bits((s)->tsv.marked, WHITE0BIT, WHITE1BIT)
 
+#if defined(LUA_PARMARK)
+/* turn `x' gray; 0 if another marker did it first */
+#define claimgray(x)  \
+   ((__sync_fetch_and_and(&(x)->gch.marked, cast_byte(~WHITEBITS)) & \
+     WHITEBITS) != 0)
+#else
+#define claimgray(x)	(lua_assert(iswhite(x)), white2gray(x), 1)
+#endif
+
 
 #define isfinalized(u)		testbit((u)->marked, FINALIZEDBIT)
 #define markfinalized(u)	l_setbit((u)->marked, FINALIZEDBIT)
@@ -58,6 +77,9 @@
 
 #define setthreshold(g)  (g->GCthreshold = (g->estimate/100) * g->gcpause)
 
+#define setminorthreshold(g)  \
+  (g->GCthreshold = g->totalbytes + (g->majorbase/100) * LUAI_GCMINOR)
+
 
 static void removeentry (Node *n) {
   lua_assert(ttisnil(gval(n)));
@@ -67,8 +89,8 @@ static void removeentry (Node *n) {
 
 
 static void reallymarkobject (global_State *g, GCObject *o) {
-  lua_assert(iswhite(o) && !isdead(g, o));
-  white2gray(o);
+  lua_assert(!isdead(g, o));
+  if (!claimgray(o)) return;
   switch (o->gch.tt) {
     case LUA_TSTRING: {
       return;
@@ -155,6 +177,15 @@ size_t luaC_separateudata (lua_State *L, int all) {
 }
 
 
+#if defined(LUA_PARMARK)
+/* markers may share a metatable: do not cache the absence of `__mode' */
+#define modetm(g,mt)	((mt) == NULL || ((mt)->flags & (1u<<TM_MODE)) ? \
+                         NULL : luaH_getstr(mt, (g)->tmname[TM_MODE]))
+#else
+#define modetm(g,mt)	gfasttm(g, mt, TM_MODE)
+#endif
+
+
 static int traversetable (global_State *g, Table *h) {
   int i;
   int weakkey = 0;
@@ -162,10 +193,11 @@ static int traversetable (global_State *g, Table *h) {
   const TValue *mode;
   if (h->metatable)
     markobject(g, h->metatable);
-  mode = gfasttm(g, h->metatable, TM_MODE);
+  mode = modetm(g, h->metatable);
   if (mode && ttisstring(mode)) {  /* is there a weak mode? */
-    weakkey = (strchr(svalue(mode), 'k') != NULL);
-    weakvalue = (strchr(svalue(mode), 'v') != NULL);
+    size_t l = tsvalue(mode)->len;  /* (it may not end with a '\0') */
+    weakkey = (memchr(svalue(mode), 'k', l) != NULL);
+    weakvalue = (memchr(svalue(mode), 'v', l) != NULL);
     if (weakkey || weakvalue) {  /* is really weak? */
       h->marked &= ~(KEYWEAK | VALUEWEAK);  /* clear bits */
       h->marked |= cast_byte((weakkey << KEYWEAKBIT) |
@@ -192,6 +224,13 @@ static int traversetable (global_State *g, Table *h) {
       if (!weakvalue) markvalue(g, gval(n));
     }
   }
+#if defined(LUA_SHAPES)
+  if (h->shape && !weakvalue) {  /* keys are marked by `markshapes' */
+    i = h->shape->nkeys;
+    while (i--)
+      markvalue(g, &h->slots[i]);
+  }
+#endif
   return weakkey || weakvalue;
 }
 
@@ -266,7 +305,8 @@ static void traversestack (global_State *g, lua_State *l) {
     markvalue(g, o);
   for (; o <= lim; o++)
     setnilvalue(o);
-  checkstacksizes(l, lim);
+  if (G(l) == g)  /* not a parallel marker? (`atomic' will shrink it) */
+    checkstacksizes(l, lim);
 }
 
 
@@ -285,7 +325,7 @@ static l_mem propagatemark (global_State *g) {
       if (traversetable(g, h))  /* table is weak? */
         black2gray(o);  /* keep it gray */
       return sizeof(Table) + sizeof(TValue) * h->sizearray +
-                             sizeof(Node) * sizenode(h);
+                             hashbytes(h) + slotbytes(h);
     }
     case LUA_TFUNCTION: {
       Closure *cl = gco2cl(o);
@@ -309,6 +349,7 @@ static l_mem propagatemark (global_State *g) {
       g->gray = p->gclist;
       traverseproto(g, p);
       return sizeof(Proto) + sizeof(Instruction) * p->sizecode +
+                             sizeof(int) * p->sizecache +
                              sizeof(Proto *) * p->sizep +
                              sizeof(TValue) * p->sizek + 
                              sizeof(int) * p->sizelineinfo +
@@ -325,6 +366,168 @@ static void propagateall (global_State *g) {
 }
 
 
+
+#if defined(LUA_PARMARK)
+
+/*
+** {======================================================
+** Parallel marking
+** =======================================================
+*/
+
+/*
+** A full collection stops the program, so its propagate phase can run
+** on several threads. Each marker works on a private copy of the
+** global state, whose `gray', `grayagain' and `weak' lists are its own;
+** `claimgray' makes sure each object is traversed by one marker only.
+** A marker that runs dry waits for objects in a shared pool, which busy
+** markers fill from their own gray lists. Thread stacks are not shrunk
+** here: `atomic' traverses them again.
+*/
+
+#define MARKPOOL	256
+#define MARKSHARE	64
+#define MARKBATCH	64
+
+typedef struct Marker {
+  pthread_t thread;
+  struct ParMark *pm;
+  global_State g;  /* private copy */
+} Marker;
+
+typedef struct ParMark {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int nmarkers;
+  volatile int idle;  /* markers waiting for work (changed under `lock') */
+  int npool;
+  GCObject *pool[MARKPOOL];
+  Marker m[LUAI_MARKTHREADS];
+} ParMark;
+
+
+static GCObject **gclistof (GCObject *o) {
+  switch (o->gch.tt) {
+    case LUA_TTABLE: return &gco2h(o)->gclist;
+    case LUA_TFUNCTION: return &gco2cl(o)->c.gclist;
+    case LUA_TTHREAD: return &gco2th(o)->gclist;
+    case LUA_TPROTO: return &gco2p(o)->gclist;
+    default: lua_assert(0); return NULL;
+  }
+}
+
+
+/* move some gray objects (but not the last one) to the pool */
+static void sharework (Marker *m) {
+  ParMark *pm = m->pm;
+  int n = 0;
+  pthread_mutex_lock(&pm->lock);
+  while (n++ < MARKSHARE && pm->npool < MARKPOOL &&
+         *gclistof(m->g.gray) != NULL) {
+    GCObject *o = m->g.gray;
+    m->g.gray = *gclistof(o);
+    pm->pool[pm->npool++] = o;
+  }
+  pthread_cond_broadcast(&pm->cond);
+  pthread_mutex_unlock(&pm->lock);
+}
+
+
+/* mark until every marker is out of work */
+static void drain (Marker *m) {
+  ParMark *pm = m->pm;
+  for (;;) {
+    int n = 0;
+    while (m->g.gray != NULL) {
+      propagatemark(&m->g);
+      if (++n % MARKBATCH == 0 && pm->idle > 0 && m->g.gray != NULL)
+        sharework(m);
+    }
+    pthread_mutex_lock(&pm->lock);
+    pm->idle++;
+    while (pm->npool == 0 && pm->idle < pm->nmarkers)
+      pthread_cond_wait(&pm->cond, &pm->lock);
+    if (pm->npool == 0) {  /* everybody is idle? */
+      pthread_cond_broadcast(&pm->cond);
+      pthread_mutex_unlock(&pm->lock);
+      return;
+    }
+    pm->idle--;
+    for (n = 0; n < MARKSHARE / 4 && pm->npool > 0; n++) {
+      GCObject *o = pm->pool[--pm->npool];
+      *gclistof(o) = m->g.gray;
+      m->g.gray = o;
+    }
+    pthread_mutex_unlock(&pm->lock);
+  }
+}
+
+
+static void *markmain (void *ud) {
+  drain(cast(Marker *, ud));
+  return NULL;
+}
+
+
+/* append list `l' to list `*p' */
+static void joinlist (GCObject **p, GCObject *l) {
+  while (*p != NULL)
+    p = gclistof(*p);
+  *p = l;
+}
+
+
+/* propagate all marks of the gray list, with helper threads */
+static void parmark (lua_State *L) {
+  global_State *g = G(L);
+  ParMark *pm;
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  int i, n = (ncpu < LUAI_MARKTHREADS) ? cast_int(ncpu) : LUAI_MARKTHREADS;
+  if (g->totalbytes < LUAI_PARMARKMIN || n < 2)
+    return;  /* not worth it */
+  pm = luaM_new(L, ParMark);
+  pthread_mutex_init(&pm->lock, NULL);
+  pthread_cond_init(&pm->cond, NULL);
+  pm->nmarkers = n;
+  pm->idle = 0;
+  pm->npool = 0;
+  for (i = 0; i < LUAI_MARKTHREADS; i++) {
+    pm->m[i].pm = pm;
+    pm->m[i].g = *g;
+    pm->m[i].g.gray = pm->m[i].g.grayagain = pm->m[i].g.weak = NULL;
+  }
+  pm->m[0].g.gray = g->gray;  /* the running thread starts with the roots */
+  g->gray = NULL;
+  for (i = 1; i < n; i++) {
+    if (pthread_create(&pm->m[i].thread, NULL, markmain, &pm->m[i]) != 0) {
+      pthread_mutex_lock(&pm->lock);
+      pm->nmarkers = i;  /* go on with the markers we have */
+      pthread_cond_broadcast(&pm->cond);
+      pthread_mutex_unlock(&pm->lock);
+      break;
+    }
+  }
+  drain(&pm->m[0]);
+  for (i = 1; i < pm->nmarkers; i++)
+    pthread_join(pm->m[i].thread, NULL);
+  for (i = 0; i < pm->nmarkers; i++) {  /* collect their lists */
+    joinlist(&g->grayagain, pm->m[i].g.grayagain);
+    joinlist(&g->weak, pm->m[i].g.weak);
+  }
+  pthread_cond_destroy(&pm->cond);
+  pthread_mutex_destroy(&pm->lock);
+  luaM_free(L, pm);
+}
+
+/* }====================================================== */
+
+#else
+
+#define parmark(L)	((void)0)
+
+#endif
+
+
 /*
 ** The next function tells whether a key or value can be cleared from
 ** a weak table. Non-collectable objects are never removed from weak
@@ -368,11 +571,36 @@ static void cleartable (GCObject *l) {
         removeentry(n);  /* remove entry from table */
       }
     }
+#if defined(LUA_SHAPES)
+    if (h->shape && testbit(h->marked, VALUEWEAKBIT)) {
+      i = h->shape->nkeys;
+      while (i--) {
+        TValue *o = &h->slots[i];
+        if (iscleared(o, 0))  /* value was collected? */
+          setnilvalue(o);  /* remove value */
+      }
+    }
+#endif
     l = h->gclist;
   }
 }
 
 
+#if defined(LUA_SHAPES)
+/*
+** shapes are kept for the whole life of the state, so their keys must
+** never be collected (tables only refer to them through the shapes)
+*/
+static void markshapes (Shape *s) {
+  for (; s != NULL; s = s->sibling) {
+    if (s->nkeys > 0)
+      stringmark(s->keys[s->nkeys - 1]);
+    markshapes(s->child);
+  }
+}
+#endif
+
+
 static void freeobj (lua_State *L, GCObject *o) {
   switch (o->gch.tt) {
     case LUA_TPROTO: luaF_freeproto(L, gco2p(o)); break;
@@ -385,8 +613,8 @@ static void freeobj (lua_State *L, GCObject *o) {
       break;
     }
     case LUA_TSTRING: {
-      G(L)->strt.nuse--;
-      luaM_freemem(L, o, sizestring(gco2ts(o)));
+      if (!islong(rawgco2ts(o))) G(L)->strt.nuse--;
+      luaS_freestr(L, rawgco2ts(o));
       break;
     }
     case LUA_TUSERDATA: {
@@ -401,6 +629,9 @@ static void freeobj (lua_State *L, GCObject *o) {
 
 #define sweepwholelist(L,p)	sweeplist(L,p,MAX_LUMEM)
 
+#define isbufstr(o)	((o)->gch.tt == LUA_TSTRING && \
+                         rawgco2ts(o)->tsv.kind == LSTRBUF)
+
 
 static GCObject **sweeplist (lua_State *L, GCObject **p, lu_mem count) {
   GCObject *curr;
@@ -411,7 +642,12 @@ static GCObject **sweeplist (lua_State *L, GCObject **p, lu_mem count) {
       sweepwholelist(L, &gco2th(curr)->openupval);
     if ((curr->gch.marked ^ WHITEBITS) & deadmask) {  /* not dead? */
       lua_assert(!isdead(g, curr) || testbit(curr->gch.marked, FIXEDBIT));
-      makewhite(g, curr);  /* make it white (for next cycle) */
+      if (g->gckind != KGC_GEN || iswhite(curr))  /* (white if fixed) */
+        makewhite(g, curr);  /* make it white (for next cycle) */
+      if (g->gckind == KGC_GEN)
+        l_setbit(curr->gch.marked, OLDBIT);  /* it keeps its mark */
+      if (isbufstr(curr))
+        luaS_trim(L, rawgco2ts(curr));  /* its buffer may be too long */
       p = &curr->gch.next;
     }
     else {  /* must erase `curr' */
@@ -426,8 +662,233 @@ static GCObject **sweeplist (lua_State *L, GCObject **p, lu_mem count) {
 }
 
 
+/*
+** sweep the young objects of a list: new objects are always linked at
+** its head (and `luaS_rehash' keeps them there), so the first old
+** object starts the old part of the list
+*/
+static lu_int32 sweepyoung (lua_State *L, GCObject **p) {
+  GCObject *curr;
+  lu_int32 n = 0;  /* number of young objects */
+  while ((curr = *p) != NULL && !isold(curr)) {
+    p = sweeplist(L, p, 1);
+    n++;
+  }
+  return n;
+}
+
+
+#if defined(LUA_BGSWEEP)
+
+/*
+** {======================================================
+** Background sweeping
+** =======================================================
+*/
+
+/*
+** At the end of the atomic phase, the objects of `rootgc' ahead of the
+** main thread (all but interned strings and userdata) go to a helper
+** thread, and `rootgc' starts again from the main thread. The mutator
+** cannot reach the dead objects among them; of the live ones, the
+** helper only changes `next' and `marked', which the mutator may read
+** but does not change until the sweep ends (barriers do nothing
+** meanwhile, whatever color they see). Interned strings, which
+** `luaS_newlstr' may resurrect, userdata and open upvalues are still
+** swept by the mutator, and so are dead threads, whose upvalues must
+** be closed; live strings in buffers go back to it too, as trimming a
+** buffer moves bytes the mutator may be reading.
+*/
+
+typedef struct BGSweep {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int state;  /* BGIDLE, BGWORK, BGDONE or BGEXIT (under `lock') */
+  lu_byte active;  /* helper owns part of the heap (changed by mutator) */
+  lu_byte white;  /* current white */
+  int deadmask;
+  GCObject *list;  /* objects to sweep, ... */
+  GCObject *stop;  /* ... up to this one */
+  GCObject *live;  /* surviving objects */
+  GCObject **livetail;  /* `next' field of the last survivor */
+  GCObject *deadthreads;  /* dead threads left to the mutator */
+  GCObject *bufstrs;  /* live strings in buffers, left to the mutator */
+  lua_State L;  /* private state for freeing objects, ... */
+  global_State g;  /* ... whose `totalbytes' counts down from MAX_LUMEM */
+} BGSweep;
+
+#define BGIDLE		0
+#define BGWORK		1
+#define BGDONE		2
+#define BGEXIT		3
+
+#define bgsweeping(g)	((g)->bgsweep != NULL && (g)->bgsweep->active)
+
+
+static void bgsweeplist (BGSweep *bg) {
+  GCObject *curr = bg->list;
+  GCObject **p = &bg->live;
+  while (curr != bg->stop) {
+    GCObject *next = curr->gch.next;
+    if ((curr->gch.marked ^ WHITEBITS) & bg->deadmask) {  /* not dead? */
+      curr->gch.marked = cast_byte((curr->gch.marked & maskmarks) | bg->white);
+      if (isbufstr(curr)) {  /* the mutator may trim its buffer */
+        curr->gch.next = bg->bufstrs;
+        bg->bufstrs = curr;
+      }
+      else {
+        *p = curr;
+        p = &curr->gch.next;
+      }
+    }
+    else if (curr->gch.tt == LUA_TTHREAD) {
+      curr->gch.next = bg->deadthreads;
+      bg->deadthreads = curr;
+    }
+    else
+      freeobj(&bg->L, curr);
+    curr = next;
+  }
+  *p = NULL;
+  bg->livetail = p;
+}
+
+
+static void *bgmain (void *ud) {
+  BGSweep *bg = cast(BGSweep *, ud);
+  pthread_mutex_lock(&bg->lock);
+  for (;;) {
+    while (bg->state == BGIDLE || bg->state == BGDONE)
+      pthread_cond_wait(&bg->cond, &bg->lock);
+    if (bg->state == BGEXIT) break;
+    pthread_mutex_unlock(&bg->lock);
+    bgsweeplist(bg);
+    pthread_mutex_lock(&bg->lock);
+    bg->state = BGDONE;
+    pthread_cond_broadcast(&bg->cond);
+  }
+  pthread_mutex_unlock(&bg->lock);
+  return NULL;
+}
+
+
+static void bgsetstate (BGSweep *bg, int state) {
+  pthread_mutex_lock(&bg->lock);
+  bg->state = state;
+  pthread_cond_broadcast(&bg->cond);
+  pthread_mutex_unlock(&bg->lock);
+}
+
+
+/* create the helper thread, before a cycle starts */
+static void bginit (lua_State *L) {
+  global_State *g = G(L);
+  BGSweep *bg = luaM_new(L, BGSweep);
+  bg->state = BGIDLE;
+  bg->active = 0;
+  bg->L.l_G = &bg->g;
+  bg->g.frealloc = g->frealloc;
+  bg->g.ud = g->ud;
+  pthread_mutex_init(&bg->lock, NULL);
+  pthread_cond_init(&bg->cond, NULL);
+  if (pthread_create(&bg->thread, NULL, bgmain, bg) != 0) {
+    pthread_cond_destroy(&bg->cond);  /* no helper: sweep as usual */
+    pthread_mutex_destroy(&bg->lock);
+    luaM_free(L, bg);
+    return;
+  }
+  g->bgsweep = bg;
+}
+
+
+/* hand the objects ahead of the main thread to the helper */
+static void bgstart (lua_State *L) {
+  global_State *g = G(L);
+  BGSweep *bg = g->bgsweep;
+  GCObject *o;
+  if (bg == NULL || g->rootgc == obj2gco(g->mainthread))
+    return;
+  /* `grayagain' has all live threads */
+  for (o = g->grayagain; o != NULL; o = gco2th(o)->gclist)
+    sweepwholelist(L, &gco2th(o)->openupval);
+  bg->list = g->rootgc;
+  bg->stop = obj2gco(g->mainthread);
+  bg->deadthreads = NULL;
+  bg->bufstrs = NULL;
+  bg->deadmask = otherwhite(g);
+  bg->white = luaC_white(g);
+  bg->g.totalbytes = MAX_LUMEM;
+  bg->active = 1;
+  g->rootgc = bg->stop;  /* mutator sweeps the main thread and userdata */
+  bgsetstate(bg, BGWORK);
+}
+
+
+/*
+** if the helper has finished (or `wait' is set), take back the objects
+** it swept; returns 0 if it is still busy
+*/
+static int bgfinish (lua_State *L, int wait) {
+  global_State *g = G(L);
+  BGSweep *bg = g->bgsweep;
+  GCObject *o;
+  int done;
+  if (!bgsweeping(g)) return 1;
+  pthread_mutex_lock(&bg->lock);
+  while (wait && bg->state == BGWORK)
+    pthread_cond_wait(&bg->cond, &bg->lock);
+  done = (bg->state == BGDONE);
+  if (done) bg->state = BGIDLE;
+  pthread_mutex_unlock(&bg->lock);
+  if (!done) return 0;
+  bg->active = 0;
+  *bg->livetail = g->rootgc;  /* new objects follow the survivors */
+  g->rootgc = bg->live;
+  g->totalbytes -= MAX_LUMEM - bg->g.totalbytes;  /* memory it freed */
+  while ((o = bg->deadthreads) != NULL) {
+    bg->deadthreads = o->gch.next;
+    freeobj(L, o);
+  }
+  while ((o = bg->bufstrs) != NULL) {
+    bg->bufstrs = o->gch.next;
+    luaS_trim(L, rawgco2ts(o));
+    o->gch.next = g->rootgc;
+    g->rootgc = o;
+  }
+  return 1;
+}
+
+
+static void bgstop (lua_State *L) {
+  global_State *g = G(L);
+  BGSweep *bg = g->bgsweep;
+  if (bg == NULL) return;
+  bgfinish(L, 1);
+  bgsetstate(bg, BGEXIT);
+  pthread_join(bg->thread, NULL);
+  pthread_cond_destroy(&bg->cond);
+  pthread_mutex_destroy(&bg->lock);
+  luaM_free(L, bg);
+  g->bgsweep = NULL;
+}
+
+/* }====================================================== */
+
+#else
+
+#define bgsweeping(g)	0
+#define bgfinish(L,w)	1
+
+#endif
+
+
+/* may allocate a new string array, so it updates `estimate' itself */
 static void checkSizes (lua_State *L) {
   global_State *g = G(L);
+  lu_mem old;
+  luaS_rehash(L, MAX_INT);  /* finish any resize begun in this cycle */
+  old = g->totalbytes;
   /* check size of string hash */
   if (g->strt.nuse < cast(lu_int32, g->strt.size/4) &&
       g->strt.size > MINSTRTABSIZE*2)
@@ -437,6 +898,7 @@ static void checkSizes (lua_State *L) {
     size_t newsize = luaZ_sizebuffer(&g->buff) / 2;
     luaZ_resizebuffer(L, &g->buff, newsize);
   }
+  g->estimate += g->totalbytes - old;
 }
 
 
@@ -478,13 +940,34 @@ void luaC_callGCTM (lua_State *L) {
 }
 
 
+/*
+** release the blocks used by prototypes without freeing them
+*/
+static void unmapall (lua_State *L) {
+  GCObject *o;
+  for (o = G(L)->rootgc; o != NULL; o = o->gch.next) {
+    if (o->gch.tt == LUA_TPROTO && gco2p(o)->map != NULL) {
+      luaF_unmap(L, gco2p(o)->map);
+      gco2p(o)->map = NULL;
+    }
+  }
+}
+
+
 void luaC_freeall (lua_State *L) {
   global_State *g = G(L);
   int i;
+#if defined(LUA_BGSWEEP)
+  bgstop(L);
+#endif
+  if (g->bulkfree) {  /* allocator will release them all at once, ... */
+    if (g->hasmaps) unmapall(L);  /* ... but not the blocks of chunks */
+    return;
+  }
   g->currentwhite = WHITEBITS | bitmask(SFIXEDBIT);  /* mask to collect all elements */
   sweepwholelist(L, &g->rootgc);
-  for (i = 0; i < g->strt.size; i++)  /* free all string lists */
-    sweepwholelist(L, &g->strt.hash[i]);
+  for (i = 0; i < strlists(&g->strt); i++)  /* free all string lists */
+    sweepwholelist(L, strlist(&g->strt, i));
 }
 
 
@@ -495,11 +978,26 @@ static void markmt (global_State *g) {
 }
 
 
+/*
+** In generational mode, old objects are not marked again, but threads
+** and weak tables stay gray, so the collector would not reach them.
+** Both kinds are left by the last cycle in `grayagain' and `weak'; this
+** joins the lists to be traversed again in the next cycle.
+*/
+static GCObject *keepgray (global_State *g) {
+  GCObject **p = &g->weak;
+  while (*p != NULL)
+    p = &gco2h(*p)->gclist;
+  *p = g->grayagain;
+  return g->weak;
+}
+
+
 /* mark root set */
 static void markroot (lua_State *L) {
   global_State *g = G(L);
   g->gray = NULL;
-  g->grayagain = NULL;
+  g->grayagain = (g->gckind == KGC_GEN) ? keepgray(g) : NULL;
   g->weak = NULL;
   markobject(g, g->mainthread);
   /* make global table be traversed before main stack */
@@ -533,6 +1031,9 @@ static void atomic (lua_State *L) {
   lua_assert(!iswhite(obj2gco(g->mainthread)));
   markobject(g, L);  /* mark running thread */
   markmt(g);  /* mark basic metatables (again) */
+#if defined(LUA_SHAPES)
+  markshapes(&g->rootshape);
+#endif
   propagateall(g);
   /* remark gray again */
   g->gray = g->grayagain;
@@ -548,6 +1049,10 @@ static void atomic (lua_State *L) {
   g->sweepgc = &g->rootgc;
   g->gcstate = GCSsweepstring;
   g->estimate = g->totalbytes - udsize;  /* first estimate */
+#if defined(LUA_BGSWEEP)
+  if (g->gckind == KGC_NORMAL)
+    bgstart(L);
+#endif
 }
 
 
@@ -556,6 +1061,10 @@ static l_mem singlestep (lua_State *L) {
   /*lua_checkmemory(L);*/
   switch (g->gcstate) {
     case GCSpause: {
+#if defined(LUA_BGSWEEP)
+      if (g->bgsweep == NULL && g->estimate >= LUAI_BGSWEEPMIN)
+        bginit(L);  /* heap is big enough to pay for a thread */
+#endif
       markroot(L);  /* start a new collection */
       return 0;
     }
@@ -569,8 +1078,8 @@ static l_mem singlestep (lua_State *L) {
     }
     case GCSsweepstring: {
       lu_mem old = g->totalbytes;
-      sweepwholelist(L, &g->strt.hash[g->sweepstrgc++]);
-      if (g->sweepstrgc >= g->strt.size)  /* nothing more to sweep? */
+      sweepwholelist(L, strlist(&g->strt, g->sweepstrgc));
+      if (++g->sweepstrgc >= strlists(&g->strt))  /* nothing more to sweep? */
         g->gcstate = GCSsweep;  /* end sweep-string phase */
       lua_assert(old >= g->totalbytes);
       g->estimate -= old - g->totalbytes;
@@ -579,12 +1088,12 @@ static l_mem singlestep (lua_State *L) {
     case GCSsweep: {
       lu_mem old = g->totalbytes;
       g->sweepgc = sweeplist(L, g->sweepgc, GCSWEEPMAX);
-      if (*g->sweepgc == NULL) {  /* nothing more to sweep? */
-        checkSizes(L);
+      if (*g->sweepgc == NULL && bgfinish(L, 0))  /* nothing more to sweep? */
         g->gcstate = GCSfinalize;  /* end sweep phase */
-      }
       lua_assert(old >= g->totalbytes);
       g->estimate -= old - g->totalbytes;
+      if (g->gcstate == GCSfinalize)
+        checkSizes(L);
       return GCSWEEPMAX*GCSWEEPCOST;
     }
     case GCSfinalize: {
@@ -603,9 +1112,87 @@ static l_mem singlestep (lua_State *L) {
 }
 
 
+/*
+** {======================================================
+** Generational mode
+** =======================================================
+*/
+
+/*
+** Objects that survive a collection in generational mode become old:
+** they keep their marks, so the next (minor) collections only mark
+** young objects, plus the old ones that barriers or `keepgray' put
+** back in the gray lists. Between collections the collector stays in
+** the propagate phase, where barriers keep black objects from pointing
+** to white ones.
+*/
+
+
+/* sweep everything marked by the last atomic phase and start a new cycle */
+static void sweepgen (lua_State *L) {
+  global_State *g = G(L);
+  lu_mem old = g->totalbytes;
+  GCObject *o;
+  lu_int32 young = g->strt.nuse - g->oldstrings;  /* strings not swept yet */
+  int i;
+  lua_assert(g->gcstate == GCSsweepstring);
+  for (i = 0; young > 0 && i < strlists(&g->strt); i++)
+    young -= sweepyoung(L, strlist(&g->strt, i));
+  g->oldstrings = g->strt.nuse;
+  g->gcstate = GCSsweep;
+  /* old threads are not reached below; they are all in `grayagain' */
+  for (o = g->grayagain; o != NULL; o = gco2th(o)->gclist)
+    sweepwholelist(L, &gco2th(o)->openupval);
+  sweepyoung(L, &g->rootgc);
+  sweepyoung(L, &g->mainthread->next);  /* userdata are linked here */
+  lua_assert(old >= g->totalbytes);
+  g->estimate -= old - g->totalbytes;
+  checkSizes(L);
+  markroot(L);
+  luaC_callGCTM(L);
+}
+
+
+static void youngcollection (lua_State *L) {
+  global_State *g = G(L);
+  lua_assert(g->gcstate == GCSpropagate);
+  while (g->gcstate != GCSsweepstring)  /* mark young objects */
+    singlestep(L);
+  sweepgen(L);
+}
+
+
+static void genstep (lua_State *L) {
+  global_State *g = G(L);
+  if (g->estimate > (g->majorbase/100) * g->gcpause)  /* old gen. too big? */
+    luaC_fullgc(L);  /* major collection */
+  else
+    youngcollection(L);
+  setminorthreshold(g);
+}
+
+
+void luaC_changemode (lua_State *L, int kind) {
+  global_State *g = G(L);
+  if (kind == g->gckind) return;
+  g->gckind = cast_byte(kind);
+  luaC_fullgc(L);  /* whiten everything and collect in the new mode */
+  if (kind == KGC_GEN)
+    setminorthreshold(g);
+}
+
+/* }====================================================== */
+
+
 void luaC_step (lua_State *L) {
   global_State *g = G(L);
   l_mem lim = (GCSTEPSIZE/100) * g->gcstepmul;
+  if (g->strt.oldhash != NULL)  /* string table still being resized? */
+    luaS_rehash(L, GCREHASHMAX + g->strt.oldsize/GCREHASHDIV);
+  if (g->gckind == KGC_GEN) {
+    genstep(L);
+    return;
+  }
   if (lim == 0)
     lim = (MAX_LUMEM-1)/2;  /* no limit */
   g->gcdept += g->totalbytes - g->GCthreshold;
@@ -631,6 +1218,9 @@ void luaC_step (lua_State *L) {
 
 void luaC_fullgc (lua_State *L) {
   global_State *g = G(L);
+  int kind = g->gckind;
+  g->gckind = KGC_NORMAL;  /* old objects must be whitened too */
+  luaS_rehash(L, MAX_INT);  /* finish any resize of the string table */
   if (g->gcstate <= GCSpropagate) {
     /* reset sweep marks to sweep all elements (returning them to white) */
     g->sweepstrgc = 0;
@@ -642,13 +1232,27 @@ void luaC_fullgc (lua_State *L) {
     g->gcstate = GCSsweepstring;
   }
   lua_assert(g->gcstate != GCSpause && g->gcstate != GCSpropagate);
+  (void)bgfinish(L, 1);  /* wait for any background sweep */
   /* finish any pending sweep phase */
   while (g->gcstate != GCSfinalize) {
     lua_assert(g->gcstate == GCSsweepstring || g->gcstate == GCSsweep);
     singlestep(L);
   }
   markroot(L);
+  parmark(L);
+  if (kind == KGC_GEN) {  /* major collection */
+    g->gckind = KGC_GEN;
+    while (g->gcstate != GCSsweepstring)  /* mark everything */
+      singlestep(L);
+    g->oldstrings = 0;  /* all strings are young */
+    sweepgen(L);  /* all survivors become old */
+    g->majorbase = g->estimate;
+    setminorthreshold(g);
+    return;
+  }
   while (g->gcstate != GCSpause) {
+    if (g->gcstate == GCSsweep)
+      (void)bgfinish(L, 1);
     singlestep(L);
   }
   setthreshold(g);
@@ -659,11 +1263,11 @@ void luaC_barrierf (lua_State *L, GCObject *o, GCObject *v) {
   global_State *g = G(L);
   lua_assert(isblack(o) && iswhite(v) && !isdead(g, v) && !isdead(g, o));
   lua_assert(g->gcstate != GCSfinalize && g->gcstate != GCSpause);
-  lua_assert(ttype(&o->gch) != LUA_TTABLE);
+  lua_assert(o->gch.tt != LUA_TTABLE);
   /* must keep invariant? */
   if (g->gcstate == GCSpropagate)
     reallymarkobject(g, v);  /* restore invariant */
-  else  /* don't mind */
+  else if (!bgsweeping(g))  /* don't mind */
     makewhite(g, o);  /* mark as white just to avoid other barriers */
 }
 
@@ -671,6 +1275,7 @@ void luaC_barrierf (lua_State *L, GCObject *o, GCObject *v) {
 void luaC_barrierback (lua_State *L, Table *t) {
   global_State *g = G(L);
   GCObject *o = obj2gco(t);
+  if (bgsweeping(g)) return;  /* `t' may belong to the sweeping thread */
   lua_assert(isblack(o) && !isdead(g, o));
   lua_assert(g->gcstate != GCSfinalize && g->gcstate != GCSpause);
   black2gray(o);  /* make table gray (again) */
@@ -691,6 +1296,7 @@ void luaC_link (lua_State *L, GCObject *o, lu_byte tt) {
 void luaC_linkupval (lua_State *L, UpVal *uv) {
   global_State *g = G(L);
   GCObject *o = obj2gco(uv);
+  resetbit(o->gch.marked, OLDBIT);  /* head of `rootgc' is for young objects */
   o->gch.next = g->rootgc;  /* link upvalue into `rootgc' list */
   g->rootgc = o;
   if (isgray(o)) { 
@@ -5,7 +5,9 @@
 */
 
 
+#include <ctype.h>
 #include <errno.h>
+#include <locale.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -254,13 +256,111 @@ static int io_lines (lua_State *L) {
 */
 
 
+/*
+** a numeral being read from a file, at most LUAI_MAXNUMERAL chars
+** long, and the char after it
+*/
+typedef struct RN {
+  FILE *f;
+  int c;  /* current char (look ahead) */
+  int n;  /* number of chars in `buff' */
+  char buff[LUAI_MAXNUMERAL + 1];
+} RN;
+
+
+/* add the current char to the numeral and read the next one */
+static int nextc (RN *rn) {
+  if (rn->n >= LUAI_MAXNUMERAL) {  /* numeral too long? */
+    rn->buff[0] = '\0';  /* invalidate result */
+    return 0;
+  }
+  rn->buff[rn->n++] = (char)rn->c;
+  rn->c = getc(rn->f);
+  return 1;
+}
+
+
+/* accept the current char if it is one of the two in `set' */
+static int test2 (RN *rn, const char *set) {
+  if (rn->c == set[0] || rn->c == set[1])
+    return nextc(rn);
+  else return 0;
+}
+
+
+static int readdigits (RN *rn, int hex) {
+  int count = 0;
+  while ((hex ? isxdigit(rn->c) : isdigit(rn->c)) && nextc(rn))
+    count++;
+  return count;
+}
+
+
+/* read `name' (in lower case) ignoring case; return the chars matched */
+static int readname (RN *rn, const char *name) {
+  int i = 0;
+  while (name[i] != '\0' && tolower(rn->c) == name[i] && nextc(rn))
+    i++;
+  return i;
+}
+
+
+/*
+** read the longest prefix that looks like a numeral and convert it as
+** `tonumber' does, instead of with `fscanf' and LUA_NUMBER_SCAN; like
+** `fscanf', it cannot push back more than the one char after it
+*/
 static int read_number (lua_State *L, FILE *f) {
-  lua_Number d;
-  if (fscanf(f, LUA_NUMBER_SCAN, &d) == 1) {
+  RN rn;
+  int count = 0;
+  int hex = 0;
+  int mant;  /* length of the numeral without a bad exponent */
+  char decp[2];
+  struct lconv *cv = localeconv();
+  rn.f = f;
+  rn.n = 0;
+  decp[0] = '.';  /* accept both the C and the locale decimal points */
+  decp[1] = (cv ? cv->decimal_point[0] : '.');
+  do { rn.c = getc(f); } while (isspace(rn.c));  /* skip spaces */
+  test2(&rn, "-+");  /* optional sign */
+  if (tolower(rn.c) == 'i') {  /* `inf' or `infinity', as `fscanf' reads */
+    int l = readname(&rn, "infinity");
+    count = (l == 3 || l == 8);
+    mant = rn.n;
+  }
+  else if (tolower(rn.c) == 'n') {  /* `nan' */
+    count = (readname(&rn, "nan") == 3);
+    mant = rn.n;
+  }
+  else {
+    if (test2(&rn, "00")) {
+      if (test2(&rn, "xX")) hex = 1;  /* numeral is hexadecimal */
+      else count = 1;  /* count initial '0' as a valid digit */
+    }
+    count += readdigits(&rn, hex);  /* integral part */
+    if (test2(&rn, decp))  /* decimal point? */
+      count += readdigits(&rn, hex);  /* fractional part */
+    mant = rn.n;
+    if (count > 0 && test2(&rn, (hex ? "pP" : "eE"))) {  /* exponent? */
+      test2(&rn, "-+");  /* exponent sign */
+      if (readdigits(&rn, 0) > 0)  /* exponent digits? */
+        mant = rn.n;
+    }
+  }
+  ungetc(rn.c, f);  /* unread look-ahead char */
+  rn.buff[mant] = '\0';  /* like `fscanf', drop an exponent without digits */
+  lua_pushstring(L, rn.buff);  /* convert it through the core */
+  if (count > 0 && lua_isnumber(L, -1)) {
+    lua_Number d = lua_tonumber(L, -1);
+    lua_pop(L, 1);
     lua_pushnumber(L, d);
     return 1;
   }
-  else return 0;  /* read fails */
+  else {
+    lua_pop(L, 1);
+    lua_pushnil(L);  /* "result" to be removed */
+    return 0;  /* read fails */
+  }
 }
 
 
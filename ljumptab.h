@@ -0,0 +1,96 @@
+/*
+** $Id: ljumptab.h $
+** Jump table for the threaded dispatch of 'luaV_execute'
+** See Copyright Notice in lua.h
+*/
+
+/*
+** This file must be included inside 'luaV_execute', as label addresses
+** are only meaningful inside the function that defines the labels.
+** The order of the entries must follow the order of 'OpCode'.
+*/
+
+#undef vmdispatch
+#undef vmcase
+#undef vmbreak
+#undef vmfetch
+#undef updatehook
+
+/*
+** the hooked variant of the interpreter dispatches through `hooktab',
+** whose entries all lead to the hook handler; the unhooked one never
+** tests the hook mask at all
+*/
+#define updatehook()	\
+  (disp = (L->hookmask & (LUA_MASKLINE | LUA_MASKCOUNT)) ? hooktab : disptab)
+
+#define vmfetch()	{ \
+  i = *pc++; \
+  ra = RA(i); \
+  lua_assert(base == L->base && L->base == L->ci->base); \
+  lua_assert(base <= L->top && L->top <= L->stack + L->stacksize); \
+  lua_assert(L->top == L->ci->top || luaG_checkopenop(i)); \
+}
+
+#define vmdispatch(x)	goto *disp[x];
+
+#define vmcase(l)	L_##l:
+
+#define vmbreak		{ vmfetch(); vmdispatch(GET_OPCODE(i)); }
+
+
+static const void *const disptab[NUM_OPCODES] = {
+&&L_OP_MOVE,
+&&L_OP_LOADK,
+&&L_OP_LOADBOOL,
+&&L_OP_LOADNIL,
+&&L_OP_GETUPVAL,
+&&L_OP_GETGLOBAL,
+&&L_OP_GETTABLE,
+&&L_OP_SETGLOBAL,
+&&L_OP_SETUPVAL,
+&&L_OP_SETTABLE,
+&&L_OP_NEWTABLE,
+&&L_OP_SELF,
+&&L_OP_ADD,
+&&L_OP_SUB,
+&&L_OP_MUL,
+&&L_OP_DIV,
+&&L_OP_MOD,
+&&L_OP_POW,
+&&L_OP_UNM,
+&&L_OP_NOT,
+&&L_OP_LEN,
+&&L_OP_CONCAT,
+&&L_OP_JMP,
+&&L_OP_EQ,
+&&L_OP_LT,
+&&L_OP_LE,
+&&L_OP_TEST,
+&&L_OP_TESTSET,
+&&L_OP_CALL,
+&&L_OP_TAILCALL,
+&&L_OP_RETURN,
+&&L_OP_FORLOOP,
+&&L_OP_FORPREP,
+&&L_OP_TFORLOOP,
+&&L_OP_SETLIST,
+&&L_OP_CLOSE,
+&&L_OP_CLOSURE,
+&&L_OP_VARARG
+};
+
+static const void *const hooktab[NUM_OPCODES] = {
+&&L_hook, &&L_hook, &&L_hook, &&L_hook,
+&&L_hook, &&L_hook, &&L_hook, &&L_hook,
+&&L_hook, &&L_hook, &&L_hook, &&L_hook,
+&&L_hook, &&L_hook, &&L_hook, &&L_hook,
+&&L_hook, &&L_hook, &&L_hook, &&L_hook,
+&&L_hook, &&L_hook, &&L_hook, &&L_hook,
+&&L_hook, &&L_hook, &&L_hook, &&L_hook,
+&&L_hook, &&L_hook, &&L_hook, &&L_hook,
+&&L_hook, &&L_hook, &&L_hook, &&L_hook,
+&&L_hook, &&L_hook
+};
+
+const void *const *disp;  /* current dispatch table */
@@ -17,6 +17,13 @@
 
 typedef LUAI_UINT32 lu_int32;
 
+/* payload of the integer variant of numbers (see lobject.h) */
+typedef LUAI_INT32 l_int;
+
+#if defined(LUAI_UINT64)
+typedef LUAI_UINT64 lu_int64;
+#endif
+
 typedef LUAI_UMEM lu_mem;
 
 typedef LUAI_MEM l_mem;
@@ -5,6 +5,7 @@
 */
 
 #include <ctype.h>
+#include <locale.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -24,7 +25,7 @@
 
 
 
-const TValue luaO_nilobject_ = {{NULL}, LUA_TNIL};
+const TValue luaO_nilobject_ = {NILCONSTANT};
 
 
 /*
@@ -80,6 +81,8 @@ int luaO_rawequalObj (const TValue *t1, const TValue *t2) {
       return bvalue(t1) == bvalue(t2);  /* boolean true must be 1 !! */
     case LUA_TLIGHTUSERDATA:
       return pvalue(t1) == pvalue(t2);
+    case LUA_TSTRING:
+      return luaS_eqstr(rawtsvalue(t1), rawtsvalue(t2));
     default:
       lua_assert(iscollectable(t1));
       return gcvalue(t1) == gcvalue(t2);
@@ -87,7 +90,142 @@ int luaO_rawequalObj (const TValue *t1, const TValue *t2) {
 }
 
 
-int luaO_str2d (const char *s, lua_Number *result) {
+#if defined(LUA_FASTSTR2NUM)
+
+/*
+** {======================================================
+** String to number
+** =======================================================
+*/
+
+#define MAXSIGDIGITS	19  /* any 19 decimal digits fit in 64 bits */
+
+/* powers of 10 that are exact in a double */
+static const double pow10tab[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+  1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+
+/*
+** read a plain decimal numeral (`[spaces][sign]digits[.digits]
+** [e[sign]digits][spaces]', without regard to the locale) as
+** `w'*10^`e'; returns 0 if `s' is something else or has too many
+** significant digits
+*/
+static int scandec (const char *s, lu_int64 *w, int *e, int *neg) {
+  lu_int64 a = 0;
+  int nsig = 0, ndigits = 0, x = 0;
+  while (isspace(cast(unsigned char, *s))) s++;
+  *neg = (*s == '-');
+  if (*s == '-' || *s == '+') s++;
+  for (; isdigit(cast(unsigned char, *s)); s++, ndigits++) {
+    if (a != 0 || *s != '0') {  /* skip leading zeros */
+      a = a*10 + (*s - '0');
+      nsig++;
+    }
+  }
+  if (*s == '.') {
+    for (s++; isdigit(cast(unsigned char, *s)); s++, ndigits++) {
+      if (a != 0 || *s != '0') {
+        a = a*10 + (*s - '0');
+        nsig++;
+      }
+      x--;
+    }
+  }
+  if (ndigits == 0 || nsig > MAXSIGDIGITS) return 0;
+  if (*s == 'e' || *s == 'E') {
+    int ex = 0, eneg;
+    s++;
+    eneg = (*s == '-');
+    if (*s == '-' || *s == '+') s++;
+    if (!isdigit(cast(unsigned char, *s))) return 0;
+    for (; isdigit(cast(unsigned char, *s)); s++)
+      if (ex < 10000) ex = ex*10 + (*s - '0');
+    x += eneg ? -ex : ex;
+  }
+  while (isspace(cast(unsigned char, *s))) s++;
+  if (*s != '\0') return 0;
+  *w = a;
+  *e = x;
+  return 1;
+}
+
+
+/*
+** convert `w'*10^`e' to the nearest double; returns 0 when that
+** cannot be done exactly here
+*/
+static int dec2num (lu_int64 w, int e, lua_Number *result) {
+  if (w == 0)
+    *result = 0;
+  else if (w <= (cast(lu_int64, 1) << 53) && -22 <= e && e <= 22) {
+    /* both operands are exact, so the one rounding is correct */
+    if (e >= 0) *result = cast_num(w) * pow10tab[e];
+    else *result = cast_num(w) / pow10tab[-e];
+  }
+#if defined(__SIZEOF_INT128__)
+  else if (e >= 0) {  /* exact integer up to 2^128 */
+    unsigned __int128 n = w;
+    for (; e > 0; e--) {
+      if (n > ~cast(unsigned __int128, 0) / 10) return 0;
+      n *= 10;
+    }
+    *result = cast_num(n);
+  }
+  else if (e >= -MAXSIGDIGITS) {  /* divide by 10^-e < 2^64 */
+    unsigned __int128 n = w, d = 1, q;
+    int sh = 64 + __builtin_clzll(w);
+    for (; e < 0; e++) d *= 10;
+    n <<= sh;  /* now 2^127 <= n */
+    q = n / d;  /* at least 64 bits */
+    if (n % d != 0) q |= 1;  /* sticky bit for the rounding below */
+    *result = ldexp(cast_num(q), -sh);
+  }
+#endif
+  else return 0;
+  return 1;
+}
+
+
+static int str2dec (const char *s, lua_Number *result) {
+  lu_int64 w;
+  int e, neg;
+  if (!scandec(s, &w, &e, &neg) || !dec2num(w, e, result)) return 0;
+  if (neg) *result = luai_numunm(*result);
+  return 1;
+}
+
+/* }====================================================== */
+
+#else
+
+/*
+** fast path for plain decimal integers (`[spaces][sign]digits[spaces]')
+** short enough to be read exactly; anything else goes to
+** `lua_str2number'
+*/
+static int str2dec (const char *s, lua_Number *result) {
+  lua_Number a = 0;
+  int neg = 0;
+  int ndigits = 0;
+  while (isspace(cast(unsigned char, *s))) s++;
+  if (*s == '-') { s++; neg = 1; }
+  else if (*s == '+') s++;
+  for (; isdigit(cast(unsigned char, *s)); s++, ndigits++)
+    a = a*10 + (*s - '0');
+  if (ndigits == 0 || ndigits > 15) return 0;  /* no digits or not exact? */
+  while (isspace(cast(unsigned char, *s))) s++;
+  if (*s != '\0') return 0;  /* not a plain integer */
+  *result = neg ? luai_numunm(a) : a;
+  return 1;
+}
+
+#endif
+
+
+static int strtonum (const char *s, lua_Number *result) {
   char *endptr;
   *result = lua_str2number(s, &endptr);
   if (endptr == s) return 0;  /* conversion failed */
@@ -100,6 +238,240 @@ int luaO_str2d (const char *s, lua_Number *result) {
 }
 
 
+int luaO_str2d (const char *s, lua_Number *result) {
+  if (str2dec(s, result)) return 1;  /* most common case */
+  if (strtonum(s, result)) return 1;
+#if defined(LUA_FASTSTR2NUM)
+  {  /* `lua_str2number' follows the locale: retry with its decimal point */
+    const char *pt = strchr(s, '.');
+    struct lconv *cv = localeconv();
+    char point = (cv ? cv->decimal_point[0] : '.');
+    char buff[LUAI_MAXNUMERAL + 1];
+    if (pt != NULL && point != '.' && strlen(s) <= LUAI_MAXNUMERAL) {
+      strcpy(buff, s);
+      buff[pt - s] = point;
+      return strtonum(buff, result);
+    }
+  }
+#endif
+  return 0;
+}
+
+
+/*
+** set `obj' to `n', using the integer variant when `n' has an exact
+** integer representation (-0 has none)
+*/
+void luaO_setnumber (TValue *obj, lua_Number n) {
+  l_int i;
+  lua_number2int(i, n);
+  if (luai_numeq(cast_num(i), n) &&
+      (i != 0 || luai_numlt(0, luai_numdiv(1, n)))) {
+    setivalue(obj, i);
+  }
+  else {
+    setnvalue(obj, n);
+  }
+}
+
+
+
+
+#if defined(LUA_FASTNUM2STR)
+
+/*
+** {======================================================
+** Number to string
+** =======================================================
+*/
+
+#if defined(LUA_NUMBER_SHORTEST)
+#define NUMDIGITS	17  /* enough digits for any double */
+#else
+#define NUMDIGITS	14  /* as in LUA_NUMBER_FMT */
+#endif
+
+
+/* write the decimal digits of `n' ending at `e'; returns where they start */
+static char *digits2str (char *e, lu_int64 n) {
+  do {
+    *--e = cast(char, '0' + cast_int(n % 10));
+    n /= 10;
+  } while (n != 0);
+  return e;
+}
+
+
+#if defined(__SIZEOF_INT128__)
+
+typedef unsigned __int128 lu_int128;
+
+/*
+** round `m'*2^`e'*10^`k' to an integer, ties to even as `printf' does in
+** the default rounding mode; returns 0 if that cannot be done exactly in
+** 128 bits
+*/
+static int scaleround (lu_int64 m, int e, int k, lu_int128 *res) {
+  lu_int128 num = m, d = 1, q, r;
+  int i;
+  if (k > 22 || k < -38) return 0;
+  for (i = 0; i < k; i++) num *= 10;  /* m*10^k < 2^(53+75) */
+  for (i = 0; i < -k; i++) d *= 10;
+  if (e >= 0) {
+    if (e > 127 || (num >> (127 - e)) > 1) return 0;
+    num <<= e;
+  }
+  else {
+    if (-e > 127 || (d >> (127 + e)) > 1) return 0;
+    d <<= -e;
+  }
+  q = num / d;
+  r = num % d;
+  if (r > d - r || (r == d - r && (q & 1)))  /* above half or a tie? */
+    q++;
+  *res = q;
+  return 1;
+}
+
+
+/*
+** round positive `v' to `p' significant digits: returns them and the
+** decimal exponent of the first one, or 0 if out of the exact range
+*/
+static int roundsig (double v, int p, lu_int64 *dg, int *x) {
+  lu_int64 bits, m, lim = 1;
+  lu_int128 n;
+  int e, i;
+  memcpy(&bits, &v, sizeof(bits));
+  e = cast_int((bits >> 52) & 0x7ff);
+  m = bits & ((cast(lu_int64, 1) << 52) - 1);
+  if (e == 0) e = -1074;  /* subnormal */
+  else { m |= cast(lu_int64, 1) << 52; e -= 1075; }
+  for (i = 1; i < p; i++) lim *= 10;  /* 10^(p-1) */
+  *x = cast_int(floor(log10(v)));  /* may be one off */
+  for (;;) {
+    if (!scaleround(m, e, p - 1 - *x, &n)) return 0;
+    if (n >= cast(lu_int128, lim) * 10) (*x)++;  /* too many digits? */
+    else if (n < lim) (*x)--;  /* too few? */
+    else break;
+  }
+  *dg = cast(lu_int64, n);
+  return 1;
+}
+
+#else
+
+#define roundsig(v,p,dg,x)	0
+
+#endif
+
+
+/*
+** write `p' digits `dg' of a number with decimal exponent `x' as "%.*g"
+** does with precision `fp'
+*/
+static char *layout (char *s, lu_int64 dg, int p, int x, int fp) {
+  char buff[NUMDIGITS];
+  char *d = digits2str(buff + NUMDIGITS, dg);
+  int nd = p;
+  while (nd > 1 && d[nd-1] == '0') nd--;  /* remove trailing zeros */
+  if (x < -4 || x >= fp) {  /* d.ddde+xx */
+    int ex = (x < 0) ? -x : x;
+    *s++ = d[0];
+    if (nd > 1) {
+      *s++ = '.';
+      memcpy(s, d + 1, nd - 1);
+      s += nd - 1;
+    }
+    *s++ = 'e';
+    *s++ = (x < 0) ? '-' : '+';
+    if (ex >= 100) {
+      *s++ = cast(char, '0' + ex / 100);
+      ex %= 100;
+    }
+    *s++ = cast(char, '0' + ex / 10);  /* at least two digits */
+    *s++ = cast(char, '0' + ex % 10);
+    return s;
+  }
+  else if (x < 0) {  /* 0.000ddd */
+    *s++ = '0'; *s++ = '.';
+    memset(s, '0', -x - 1);
+    s += -x - 1;
+    memcpy(s, d, nd);
+    return s + nd;
+  }
+  else if (nd <= x + 1) {  /* ddd000 */
+    memcpy(s, d, nd);
+    memset(s + nd, '0', x + 1 - nd);
+    return s + x + 1;
+  }
+  else {  /* ddd.ddd */
+    memcpy(s, d, x + 1);
+    s[x + 1] = '.';
+    memcpy(s + x + 2, d + x + 1, nd - x - 1);
+    return s + nd + 1;
+  }
+}
+
+
+/* write positive `n' with `p' significant digits, like "%.*g" */
+static char *fmtdigits (char *s, lua_Number n, int p, int fp) {
+  lu_int64 dg;
+  int x;
+  if (roundsig(n, p, &dg, &x))
+    return layout(s, dg, p, x, fp);
+  else  /* out of the exact range: rare */
+    return s + sprintf(s, "%.*g", p, n);
+}
+
+
+/*
+** convert `n' to a string in `s' (with room for LUAI_MAXNUMBER2STR
+** chars) as `sprintf' with LUA_NUMBER_FMT would; returns its length
+*/
+int luaO_num2str (char *s, lua_Number n) {
+  char *e = s;
+  if (n != n || n - n != 0)  /* NaN or infinite? */
+    return sprintf(s, LUA_NUMBER_FMT, n);
+  if (n < 0 || (n == 0 && 1/n < 0)) {
+    *e++ = '-';
+    n = -n;
+  }
+  if (n < 1e15 && n == floor(n)) {  /* integral? */
+    char buff[15];
+    char *d = digits2str(buff + sizeof(buff), cast(lu_int64, n));
+    int l = cast_int(buff + sizeof(buff) - d);
+    if (l <= NUMDIGITS) {  /* printed exactly */
+      memcpy(e, d, l);
+      e += l;
+      *e = '\0';
+      return cast_int(e - s);
+    }
+  }
+#if defined(LUA_NUMBER_SHORTEST)
+  {  /* find the fewest digits that read back as `n' */
+    int lo = 1, hi = NUMDIGITS;
+    while (lo < hi) {
+      int p = (lo + hi) / 2;
+      char *end;
+      *fmtdigits(e, n, p, NUMDIGITS) = '\0';
+      if (lua_str2number(e, &end) == n) hi = p;
+      else lo = p + 1;
+    }
+    e = fmtdigits(e, n, lo, NUMDIGITS);
+  }
+#else
+  e = fmtdigits(e, n, NUMDIGITS, NUMDIGITS);
+#endif
+  *e = '\0';
+  return cast_int(e - s);
+}
+
+/* }====================================================== */
+
+#endif
+
+
 
 static void pushstr (lua_State *L, const char *str) {
   setsvalue2s(L, L->top, luaS_new(L, str));
@@ -165,7 +537,7 @@ const char *luaO_pushvfstring (lua_State *L, const char *fmt, va_list argp) {
   pushstr(L, fmt);
   luaV_concat(L, n+1, cast_int(L->top - L->base) - 1);
   L->top -= n;
-  return svalue(L->top - 1);
+  return luaS_cstr(L, rawtsvalue(L->top - 1));
 }
 
 
@@ -30,6 +30,19 @@
 #define LUA_TDEADKEY	(LAST_TAG+3)
 
 
+/*
+** Numbers come in two variants, told apart by a bit above the basic
+** type in `tt': floats (tag LUA_TNUMBER) and integers (tag LUA_TNUMINT).
+** An integer is just a faster representation of a float with an exact
+** integral value (other than -0); both variants have type LUA_TNUMBER
+** and the difference is never visible to programs.
+*/
+#define LUA_TNUMINT	(LUA_TNUMBER | (1 << 4))
+
+/* mask to get the basic type from a tag */
+#define TYPEMASK	0x0F
+
+
 /*
 ** Union of all collectable objects
 */
@@ -67,6 +80,7 @@ typedef union {
   GCObject *gc; /*可回收的类型，string table function等,在 union GCObject 中有定义,下面的三个都是不能被回收的*/
   void *p;  /*light userdata 是不会被gc的*/
   lua_Number n; /*double 类型*/
+  l_int i;      /* integer variant of numbers */
   int b;        /*boolean 类型*/
 } Value;
 
@@ -75,8 +89,98 @@ typedef union {
 ** Tagged Values
 */
 
+#if !defined(LUA_NANBOX)
+
 #define TValuefields	Value value; int tt /* 标志变量的类型，实际就是不同的数字, lua.h 中 define */
 
+#define NILCONSTANT	{NULL}, LUA_TNIL
+
+/* raw tag (with variant bits) */
+#define rttype(o)	((o)->tt)
+#define checktag(o,t)	(rttype(o) == (t))
+#define ttisfloat(o)	checktag(o, LUA_TNUMBER)
+
+/* raw access to the payload */
+#define gcval_(o)	((o)->value.gc)
+#define pval_(o)	((o)->value.p)
+#define fltval_(o)	((o)->value.n)
+#define ival_(o)	((o)->value.i)
+#define bval_(o)	((o)->value.b)
+
+#define settv_(o,f,x,t)	{ (o)->value.f=(x); (o)->tt=(t); }
+#define setnv_(o,x)	settv_(o, n, x, LUA_TNUMBER)
+#define setiv_(o,x)	settv_(o, i, x, LUA_TNUMINT)
+#define setpv_(o,x)	settv_(o, p, x, LUA_TLIGHTUSERDATA)
+#define setbv_(o,x)	settv_(o, b, x, LUA_TBOOLEAN)
+#define setgcv_(o,x,t)	settv_(o, gc, x, t)
+#define setnilvalue(obj) ((obj)->tt=LUA_TNIL)
+#define setobj_(o1,o2)	{ (o1)->value = (o2)->value; (o1)->tt=(o2)->tt; }
+#define setttype(obj, tt) (rttype(obj) = (tt))
+
+#define iscollectable(o)	(ttype(o) >= LUA_TSTRING)
+
+#else  /* LUA_NANBOX */
+
+#if !defined(LUA_NUMBER_DOUBLE)
+#error "LUA_NANBOX needs 'double' as the number type"
+#endif
+
+/*
+** NaN boxing: a value is one 64-bit word. A float is stored as itself;
+** any other value lives among the negative quiet NaNs, with its tag
+** (basic type + 1) in bits 47-50 and its payload (a pointer, boolean
+** or integer) in the low 47 bits. Tag 0 is left to the real NaN, so
+** NaNs are normalized to that pattern when stored.
+*/
+typedef union NaNBox {
+  LUAI_UINT64 u;
+  lua_Number n;
+} NaNBox;
+
+#define TValuefields	NaNBox nb
+
+#define NB_QNAN		0x1FFF0  /* top 17 bits of a negative quiet NaN */
+#define NB_PAYLOAD	((cast(LUAI_UINT64, 1) << 47) - 1)
+
+#define nbtop(o)	cast_int((o)->nb.u >> 47)
+#define nbtag(t)	(NB_QNAN + ((t) & TYPEMASK) + 1)
+#define nbbox(t,p)	((cast(LUAI_UINT64, nbtag(t)) << 47) | (p))
+
+#define NILCONSTANT	{nbbox(LUA_TNIL, 0)}
+
+#define rttype(o)	(nbtop(o) <= NB_QNAN ? LUA_TNUMBER : \
+			 nbtop(o) == nbtag(LUA_TNUMINT) ? LUA_TNUMINT : \
+			 nbtop(o) - (NB_QNAN + 1))
+#define checktag(o,t)	(nbtop(o) == nbtag(t))
+#define ttisfloat(o)	(nbtop(o) <= NB_QNAN)
+
+#define payload_(o)	((o)->nb.u & NB_PAYLOAD)
+#define gcval_(o)	cast(GCObject *, cast(size_t, payload_(o)))
+#define pval_(o)	cast(void *, cast(size_t, payload_(o)))
+#define fltval_(o)	((o)->nb.n)
+#define ival_(o)	cast(l_int, cast(lu_int32, (o)->nb.u))
+#define bval_(o)	cast_int(cast(lu_int32, (o)->nb.u))
+
+#define setbox_(o,t,p)	((o)->nb.u = nbbox(t, p))
+#define setnv_(o,x) \
+  { (o)->nb.n=(x); \
+    if (nbtop(o) > NB_QNAN) (o)->nb.u = cast(LUAI_UINT64, NB_QNAN) << 47; }
+#define setiv_(o,x)	setbox_(o, LUA_TNUMINT, cast(lu_int32, (x)))
+#define setpv_(o,x) \
+  setbox_(o, LUA_TLIGHTUSERDATA, check_exp( \
+    (cast(LUAI_UINT64, cast(size_t, (x))) & ~NB_PAYLOAD) == 0, \
+    cast(LUAI_UINT64, cast(size_t, (x)))))
+#define setbv_(o,x)	setbox_(o, LUA_TBOOLEAN, cast(lu_int32, (x)))
+#define setgcv_(o,x,t)	setbox_(o, t, cast(LUAI_UINT64, cast(size_t, (x))))
+#define setnilvalue(obj) setbox_(obj, LUA_TNIL, 0)
+#define setobj_(o1,o2)	((o1)->nb = (o2)->nb)
+#define setttype(obj, tt) setbox_(obj, tt, payload_(obj))
+
+#define iscollectable(o)	(nbtop(o) >= nbtag(LUA_TSTRING))
+
+#endif  /* LUA_NANBOX */
+
+
 typedef struct lua_TValue {
   TValuefields;
 } TValue;
@@ -87,15 +191,17 @@ typedef struct lua_TValue {
  * 用来检测变量类型的, 返回true 或 false
  */
 
-#define ttisnil(o)	(ttype(o) == LUA_TNIL)
-#define ttisnumber(o)	(ttype(o) == LUA_TNUMBER)
-#define ttisstring(o)	(ttype(o) == LUA_TSTRING)
-#define ttistable(o)	(ttype(o) == LUA_TTABLE)
-#define ttisfunction(o)	(ttype(o) == LUA_TFUNCTION)
-#define ttisboolean(o)	(ttype(o) == LUA_TBOOLEAN)
-#define ttisuserdata(o)	(ttype(o) == LUA_TUSERDATA)
-#define ttisthread(o)	(ttype(o) == LUA_TTHREAD)
-#define ttislightuserdata(o)	(ttype(o) == LUA_TLIGHTUSERDATA)
+/* only numbers have variants, so other types can test the raw tag */
+#define ttisnil(o)	checktag(o, LUA_TNIL)
+#define ttisnumber(o)	(ttisfloat(o) || ttisint(o))
+#define ttisint(o)	checktag(o, LUA_TNUMINT)
+#define ttisstring(o)	checktag(o, LUA_TSTRING)
+#define ttistable(o)	checktag(o, LUA_TTABLE)
+#define ttisfunction(o)	checktag(o, LUA_TFUNCTION)
+#define ttisboolean(o)	checktag(o, LUA_TBOOLEAN)
+#define ttisuserdata(o)	checktag(o, LUA_TUSERDATA)
+#define ttisthread(o)	checktag(o, LUA_TTHREAD)
+#define ttislightuserdata(o)	checktag(o, LUA_TLIGHTUSERDATA)
 
 /* Macros to access values */
 /* Macros to access values
@@ -103,18 +209,22 @@ typedef struct lua_TValue {
  * 用来取值的
  */
 
-#define ttype(o)	((o)->tt)
-#define gcvalue(o)	check_exp(iscollectable(o), (o)->value.gc)
-#define pvalue(o)	check_exp(ttislightuserdata(o), (o)->value.p)
-#define nvalue(o)	check_exp(ttisnumber(o), (o)->value.n)
-#define rawtsvalue(o)	check_exp(ttisstring(o), &(o)->value.gc->ts)
+/* basic type */
+#define ttype(o)	(rttype(o) & TYPEMASK)
+#define gcvalue(o)	check_exp(iscollectable(o), gcval_(o))
+#define pvalue(o)	check_exp(ttislightuserdata(o), pval_(o))
+#define nvalue(o)	check_exp(ttisnumber(o), \
+	ttisint(o) ? cast_num(ival_(o)) : fltval_(o))
+#define fltvalue(o)	check_exp(ttisfloat(o), fltval_(o))
+#define ivalue(o)	check_exp(ttisint(o), ival_(o))
+#define rawtsvalue(o)	check_exp(ttisstring(o), &gcval_(o)->ts)
 #define tsvalue(o)	(&rawtsvalue(o)->tsv)
-#define rawuvalue(o)	check_exp(ttisuserdata(o), &(o)->value.gc->u)
+#define rawuvalue(o)	check_exp(ttisuserdata(o), &gcval_(o)->u)
 #define uvalue(o)	(&rawuvalue(o)->uv)
-#define clvalue(o)	check_exp(ttisfunction(o), &(o)->value.gc->cl)
-#define hvalue(o)	check_exp(ttistable(o), &(o)->value.gc->h)
-#define bvalue(o)	check_exp(ttisboolean(o), (o)->value.b)
-#define thvalue(o)	check_exp(ttisthread(o), &(o)->value.gc->th)
+#define clvalue(o)	check_exp(ttisfunction(o), &gcval_(o)->cl)
+#define hvalue(o)	check_exp(ttistable(o), &gcval_(o)->h)
+#define bvalue(o)	check_exp(ttisboolean(o), bval_(o))
+#define thvalue(o)	check_exp(ttisthread(o), &gcval_(o)->th)
 
 #define l_isfalse(o)	(ttisnil(o) || (ttisboolean(o) && bvalue(o) == 0))
 
@@ -123,53 +233,54 @@ typedef struct lua_TValue {
 * 只用于内部debug
 */
 #define checkconsistency(obj) \
-  lua_assert(!iscollectable(obj) || (ttype(obj) == (obj)->value.gc->gch.tt))
+  lua_assert(!iscollectable(obj) || (ttype(obj) == gcval_(obj)->gch.tt))
 
 #define checkliveness(g,obj) \
   lua_assert(!iscollectable(obj) || \
-  ((ttype(obj) == (obj)->value.gc->gch.tt) && !isdead(g, (obj)->value.gc)))
+  ((ttype(obj) == gcval_(obj)->gch.tt) && !isdead(g, gcval_(obj))))
 
 
 /* Macros to set values */
-#define setnilvalue(obj) ((obj)->tt=LUA_TNIL)
-
 #define setnvalue(obj,x) \
-  { TValue *i_o=(obj); i_o->value.n=(x); i_o->tt=LUA_TNUMBER; }
+  { TValue *i_o=(obj); setnv_(i_o, x); }
+
+#define setivalue(obj,x) \
+  { TValue *i_o=(obj); setiv_(i_o, x); }
 
 #define setpvalue(obj,x) \
-  { TValue *i_o=(obj); i_o->value.p=(x); i_o->tt=LUA_TLIGHTUSERDATA; }
+  { TValue *i_o=(obj); setpv_(i_o, x); }
 
 #define setbvalue(obj,x) \
-  { TValue *i_o=(obj); i_o->value.b=(x); i_o->tt=LUA_TBOOLEAN; }
+  { TValue *i_o=(obj); setbv_(i_o, x); }
 
 #define setsvalue(L,obj,x) \
   { TValue *i_o=(obj); \
-    i_o->value.gc=cast(GCObject *, (x)); i_o->tt=LUA_TSTRING; \
+    setgcv_(i_o, cast(GCObject *, (x)), LUA_TSTRING); \
     checkliveness(G(L),i_o); }
 
 #define setuvalue(L,obj,x) \
   { TValue *i_o=(obj); \
-    i_o->value.gc=cast(GCObject *, (x)); i_o->tt=LUA_TUSERDATA; \
+    setgcv_(i_o, cast(GCObject *, (x)), LUA_TUSERDATA); \
     checkliveness(G(L),i_o); }
 
 #define setthvalue(L,obj,x) \
   { TValue *i_o=(obj); \
-    i_o->value.gc=cast(GCObject *, (x)); i_o->tt=LUA_TTHREAD; \
+    setgcv_(i_o, cast(GCObject *, (x)), LUA_TTHREAD); \
     checkliveness(G(L),i_o); }
 
 #define setclvalue(L,obj,x) \
   { TValue *i_o=(obj); \
-    i_o->value.gc=cast(GCObject *, (x)); i_o->tt=LUA_TFUNCTION; \
+    setgcv_(i_o, cast(GCObject *, (x)), LUA_TFUNCTION); \
     checkliveness(G(L),i_o); }
 
 #define sethvalue(L,obj,x) \
   { TValue *i_o=(obj); \
-    i_o->value.gc=cast(GCObject *, (x)); i_o->tt=LUA_TTABLE; \
+    setgcv_(i_o, cast(GCObject *, (x)), LUA_TTABLE); \
     checkliveness(G(L),i_o); }
 
 #define setptvalue(L,obj,x) \
   { TValue *i_o=(obj); \
-    i_o->value.gc=cast(GCObject *, (x)); i_o->tt=LUA_TPROTO; \
+    setgcv_(i_o, cast(GCObject *, (x)), LUA_TPROTO); \
     checkliveness(G(L),i_o); }
 
 
@@ -177,7 +288,7 @@ typedef struct lua_TValue {
 
 #define setobj(L,obj1,obj2) \
   { const TValue *o2=(obj2); TValue *o1=(obj1); \
-    o1->value = o2->value; o1->tt=o2->tt; \
+    setobj_(o1, o2); \
     checkliveness(G(L),o1); }
 
 
@@ -201,11 +312,6 @@ typedef struct lua_TValue {
 #define setobj2n	setobj
 #define setsvalue2n	setsvalue
 
-#define setttype(obj, tt) (ttype(obj) = (tt))
-
-
-#define iscollectable(o)	(ttype(o) >= LUA_TSTRING)
-
 
 
 typedef TValue *StkId;  /* TValue 指针，index to stack elements */
@@ -219,14 +325,37 @@ typedef union TString {
   struct {
     CommonHeader;
     lu_byte reserved;
+    lu_byte hashed;  /* long strings: `hash' is already computed */
+    lu_byte kind;  /* long strings: LSTRFLAT, LSTRCAT or LSTRBUF */
     unsigned int hash;
     size_t len;
   } tsv;
 } TString;
 
 
-#define getstr(ts)	cast(const char *, (ts) + 1)
-#define svalue(o)       getstr(tsvalue(o))
+/*
+** Buffer shared by the strings that `luaV_concat' makes by appending
+** to other long strings: each one holds a prefix of its bytes
+*/
+typedef struct StrBuf {
+  size_t size;  /* room for bytes (besides the ending '\0') */
+  size_t used;  /* length of the longest string using it */
+  int refs;  /* number of strings using it */
+  int sealed;  /* bytes were handed out as a C string: no more appends */
+} StrBuf;
+
+#define sbufdata(b)	cast(char *, (b) + 1)
+
+/* kinds of long strings */
+#define LSTRFLAT	0	/* bytes follow the header */
+#define LSTRCAT		1	/* the same, made by a concatenation */
+#define LSTRBUF		2	/* bytes are a prefix of the `StrBuf' after header */
+
+#define strbuf(ts)	(*cast(StrBuf **, (ts) + 1))
+
+#define getstr(ts)	cast(const char *, (ts)->tsv.kind == LSTRBUF ? \
+                             sbufdata(strbuf(ts)) : cast(char *, (ts) + 1))
+#define svalue(o)       getstr(rawtsvalue(o))
 
 
 
@@ -251,6 +380,7 @@ typedef struct Proto {
   CommonHeader;
   TValue *k;  /* constants used by the function */
   Instruction *code;
+  int *cache;  /* inline caches (hash-slot hints), one per instruction */
   struct Proto **p;  /*  定义在函数内部的函数，内部函数 functions defined inside the function */
   int *lineinfo;  /* map from opcodes to source lines */
   struct LocVar *locvars;  /*有关 local 变量的一些信息， information about local variables */
@@ -259,6 +389,7 @@ typedef struct Proto {
   int sizeupvalues;
   int sizek;  /* size of `k' */
   int sizecode;
+  int sizecache;  /* size of `cache' */
   int sizelineinfo;
   int sizep;  /* size of `p' */
   int sizelocvars;
@@ -269,9 +400,23 @@ typedef struct Proto {
   lu_byte numparams;
   lu_byte is_vararg;
   lu_byte maxstacksize;
+  struct Mapping *map;  /* block holding `code' and `lineinfo' (or NULL) */
 } Proto;
 
 
+/*
+** a block given to `lua_loadblock', shared by the prototypes whose
+** code and line information point into it
+*/
+typedef struct Mapping {
+  void *block;
+  size_t size;
+  lua_Release release;  /* called when the last prototype goes */
+  void *ud;
+  int nref;  /* number of prototypes using the block (plus the loader) */
+} Mapping;
+
+
 /* masks for new-style vararg */
 #define VARARG_HASARG		1
 #define VARARG_ISVARARG		2
@@ -343,7 +488,9 @@ typedef union Closure {
 typedef union TKey {
   struct {
     TValuefields;
+#if !defined(LUA_SWISSTABLE)
     struct Node *next;  /* for chaining */
+#endif
   } nk;
   TValue tvk;
 } TKey;
@@ -354,6 +501,27 @@ typedef struct Node {
   TKey i_key;
 } Node;
 
+#if defined(LUA_SHAPES)
+
+/*
+** Shapes: a shape lists the string keys of a table in the order they
+** were added; the table keeps their values, in the same order, in its
+** `slots'. Shapes form a tree in which each child extends its parent
+** by one key.
+*/
+typedef struct Shape {
+  struct Shape *child;  /* first shape extending this one */
+  struct Shape *sibling;  /* next shape extending the same parent */
+  int nkeys;
+  TString *keys[1];
+} Shape;
+
+#define sizeshape(n)	(cast(int, sizeof(Shape)) + \
+			 cast(int, sizeof(TString *)*((n)-1)))
+
+#endif
+
+
 /*
  * Lua 的表里，数组和表都用table来表示，如果一个value没有key ，就直接到array(下面的数组部分)中，如果有key ，就放到node(下面的散列表部分)中存储
  * 所以，table.getn函数，只能返回array数组的大小,在node中的都忽略不计了
@@ -365,9 +533,20 @@ typedef struct Table {
   struct Table *metatable;
   TValue *array;  /* 数组部分，array part */
   Node *node;/*散列表部分*/
+#if !defined(LUA_SWISSTABLE)
   Node *lastfree;  /* any free position is before this position */
+#else
+  lu_byte *ctrl;  /* control byte (hash tag or empty mark) of each node */
+  int growleft;  /* number of keys that can be added before a rehash */
+#endif
   GCObject *gclist;
   int sizearray;  /* size of `array' array */
+  int lenhint;  /* last border found by `luaH_getn' */
+#if defined(LUA_SHAPES)
+  struct Shape *shape;  /* shape of string keys (NULL if they are hashed) */
+  TValue *slots;  /* values of the keys in `shape' */
+  int sizeslots;  /* size of `slots' array */
+#endif
 } Table;
 
 
@@ -397,6 +576,10 @@ LUAI_FUNC int luaO_int2fb (unsigned int x);
 LUAI_FUNC int luaO_fb2int (int x);
 LUAI_FUNC int luaO_rawequalObj (const TValue *t1, const TValue *t2);
 LUAI_FUNC int luaO_str2d (const char *s, lua_Number *result);
+LUAI_FUNC void luaO_setnumber (TValue *obj, lua_Number n);
+#if defined(LUA_FASTNUM2STR)
+LUAI_FUNC int luaO_num2str (char *s, lua_Number n);
+#endif
 LUAI_FUNC const char *luaO_pushvfstring (lua_State *L, const char *fmt,
                                                        va_list argp);
 LUAI_FUNC const char *luaO_pushfstring (lua_State *L, const char *fmt, ...);
@@ -24,6 +24,17 @@
 #include "ltm.h"
 
 
+/*
+** a source of randomness for the seed of string hashes; the addresses
+** mixed with it below change from run to run where the system
+** randomizes them
+*/
+#if !defined(luai_makeseed)
+#include <time.h>
+#define luai_makeseed()		cast(unsigned int, time(NULL))
+#endif
+
+
 #define state_size(x)	(sizeof(x) + LUAI_EXTRASPACE)
 #define fromstate(l)	(cast(lu_byte *, (l)) - LUAI_EXTRASPACE)
 #define tostate(l)   (cast(lua_State *, cast(lu_byte *, l) + LUAI_EXTRASPACE))
@@ -106,12 +117,18 @@ static void close_state (lua_State *L) {
   global_State *g = G(L);
   luaF_close(L, L->stack);  /* close all upvalues for this thread */
   luaC_freeall(L);  /* collect all objects */
-  lua_assert(g->rootgc == obj2gco(L));
-  lua_assert(g->strt.nuse == 0);
-  luaM_freearray(L, G(L)->strt.hash, G(L)->strt.size, TString *);
-  luaZ_freebuffer(L, &g->buff);
-  freestack(L, L);
-  lua_assert(g->totalbytes == sizeof(LG));
+  if (!g->bulkfree) {  /* else freeing the state frees everything */
+#if defined(LUA_SHAPES)
+    luaH_freeshapes(L);
+#endif
+    lua_assert(g->rootgc == obj2gco(L));
+    lua_assert(g->strt.nuse == 0);
+    luaM_freearray(L, G(L)->strt.hash, G(L)->strt.size, TString *);
+    luaM_freearray(L, G(L)->strt.oldhash, G(L)->strt.oldsize, TString *);
+    luaZ_freebuffer(L, &g->buff);
+    freestack(L, L);
+    lua_assert(g->totalbytes == sizeof(LG));
+  }
   (*g->frealloc)(g->ud, fromstate(L), state_size(LG), 0);
 }
 
@@ -140,6 +157,16 @@ void luaE_freethread (lua_State *L, lua_State *L1) {
 }
 
 
+static unsigned int makeseed (lua_State *L) {
+  size_t h = cast(size_t, luai_makeseed());
+  int local;
+  h ^= cast(size_t, L);  /* heap */
+  h = h * 31 + cast(size_t, &local);  /* stack */
+  h = h * 31 + cast(size_t, &lua_newstate);  /* code */
+  return cast(unsigned int, h ^ (h >> 16 >> 16));
+}
+
+
 LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
   int i;
   lua_State *L; // lua状态机
@@ -161,6 +188,7 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
   g->frealloc = f;
   g->ud = ud;
   g->mainthread = L; // 全局状态机的主线程，就是这个L
+  g->seed = makeseed(L);
 
   // upvalue 双向链表
   g->uvhead.u.l.prev = &g->uvhead;
@@ -172,12 +200,18 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
   g->strt.size = 0;
   g->strt.nuse = 0;
   g->strt.hash = NULL;
+  g->strt.oldhash = NULL;
+  g->strt.oldsize = 0;
+  g->strt.rehash = 0;
 
 
   setnilvalue(registry(L));
   luaZ_initbuffer(L, &g->buff); // 初始化buffer，这个buffer是虚拟机进行io读写时用到的
   g->panic = NULL; // 遇到错误时调用的panic函数
   g->gcstate = GCSpause; // gc停止
+  g->gckind = KGC_NORMAL;
+  g->bulkfree = 0;
+  g->hasmaps = 0;
   g->rootgc = obj2gco(L); // 可gc对象的列表, 新创建的状态机只有本身是可gc的，把自己放到链表中
 
   g->sweepstrgc = 0; // 一个标志，是否正在对存放字符串的hash表进行gc回收.hash表不够大，进行重新分配后要对旧hash表进行回收.初始化为0表示没有进行回收，1表示正在进行回收
@@ -194,6 +228,16 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
   g->gcpause = LUAI_GCPAUSE; // gc频度控制
   g->gcstepmul = LUAI_GCMUL; // 同样是gc频度
   g->gcdept = 0;
+  g->majorbase = 0;
+  g->oldstrings = 0;
+#if defined(LUA_BGSWEEP)
+  g->bgsweep = NULL;
+#endif
+#if defined(LUA_SHAPES)
+  g->rootshape.child = g->rootshape.sibling = NULL;
+  g->rootshape.nkeys = 0;
+  g->nshapes = 0;
+#endif
 
   // 各个数据类型的元表设置,初始为NULL
   for (i=0; i<NUM_TAGS; i++) g->mt[i] = NULL;
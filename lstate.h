@@ -48,9 +48,19 @@ typedef struct stringtable {
   GCObject **hash;
   lu_int32 nuse;  /* number of elements. hash 表中string的个数*/
   int size;  /*hash表的大小*/
+  GCObject **oldhash;  /* previous array, still being moved to `hash' */
+  int oldsize;
+  int rehash;  /* next list of `oldhash' to move */
 } stringtable;
 
 
+/* the `i'-th list of a string table, counting those still in `oldhash' */
+#define strlist(tb,i)	((i) < (tb)->size ? &(tb)->hash[i] \
+                                         : &(tb)->oldhash[(i) - (tb)->size])
+
+#define strlists(tb)	((tb)->size + (tb)->oldsize)
+
+
 /*
 ** informations about a call
 +* 关于调用的信息
@@ -81,6 +91,10 @@ typedef struct global_State {
   void *ud;         /* auxiliary data to `frealloc' */
   lu_byte currentwhite;
   lu_byte gcstate;  /* state of garbage collector */
+  lu_byte gckind;  /* kind of GC running (KGC_NORMAL or KGC_GEN) */
+  lu_byte bulkfree;  /* `frealloc' releases everything with the state */
+  lu_byte hasmaps;  /* some chunk was loaded with `lua_loadblock' */
+  unsigned int seed;  /* randomized seed for string hashes */
   int sweepstrgc;  /* position of sweep in `strt' */
   GCObject *rootgc;  /* list of all collectable objects */
   GCObject **sweepgc;  /* position of sweep in `rootgc' */
@@ -93,6 +107,8 @@ typedef struct global_State {
   lu_mem totalbytes;  /* number of bytes currently allocated */
   lu_mem estimate;  /* an estimate of number of bytes actually in use */
   lu_mem gcdept;  /* how much GC is `behind schedule' */
+  lu_mem majorbase;  /* memory in use after the last major collection */
+  lu_int32 oldstrings;  /* number of strings after the last sweep (gen. mode) */
   int gcpause;  /* size of pause between successive GCs */
   int gcstepmul;  /* GC `granularity' */
   lua_CFunction panic;  /* to be called in unprotected errors */
@@ -101,6 +117,13 @@ typedef struct global_State {
   UpVal uvhead;  /*整个lua虚拟机中，所有栈(一个协程一个栈)的upvalues链表的表头 head of double-linked list of all open upvalues */
   struct Table *mt[NUM_TAGS];  /* metatables for basic types */
   TString *tmname[TM_N];  /* array with tag-method names */
+#if defined(LUA_BGSWEEP)
+  struct BGSweep *bgsweep;  /* helper thread for sweeping (or NULL) */
+#endif
+#if defined(LUA_SHAPES)
+  Shape rootshape;  /* shape with no keys */
+  int nshapes;  /* number of shapes besides `rootshape' */
+#endif
 } global_State;
 
 
@@ -19,40 +19,112 @@
 
 
 
+/*
+** young strings stay at the head of their lists (as the generational
+** collector expects), so old ones go after them
+*/
+static void chainstr (GCObject **hash, int size, GCObject *p) {
+  unsigned int h = gco2ts(p)->hash;
+  GCObject **q = &hash[lmod(h, size)];
+  lua_assert(cast_int(h%size) == lmod(h, size));
+  if (isold(p))
+    while (*q != NULL && !isold(*q)) q = &(*q)->gch.next;
+  p->gch.next = *q;  /* chain it */
+  *q = p;
+}
+
+
+/*
+** Resizing only allocates the new array; `luaS_rehash' then moves the
+** lists of the old one a few at a time, and lookups search both arrays
+** meanwhile.
+*/
 void luaS_resize (lua_State *L, int newsize) {
   GCObject **newhash;
-  stringtable *tb;
+  stringtable *tb = &G(L)->strt;
   int i;
-  if (G(L)->gcstate == GCSsweepstring)
-    return;  /* cannot resize during GC traverse */
+  if (G(L)->gcstate == GCSsweepstring || tb->oldhash != NULL)
+    return;  /* cannot resize during GC traverse or while moving strings */
   newhash = luaM_newvector(L, newsize, GCObject *);
-  tb = &G(L)->strt;
   for (i=0; i<newsize; i++) newhash[i] = NULL;
-  /* rehash */
-  for (i=0; i<tb->size; i++) {
-    GCObject *p = tb->hash[i];
+  tb->oldhash = tb->hash;
+  tb->oldsize = tb->size;
+  tb->rehash = 0;
+  tb->hash = newhash;
+  tb->size = newsize;
+  luaS_rehash(L, 0);  /* old array may be empty */
+}
+
+
+/* move up to `n' lists of the old array to the new one */
+void luaS_rehash (lua_State *L, int n) {
+  stringtable *tb = &G(L)->strt;
+  if (G(L)->gcstate == GCSsweepstring)
+    return;  /* the collector is sweeping both arrays */
+  for (; n > 0 && tb->rehash < tb->oldsize; n--) {
+    GCObject *p = tb->oldhash[tb->rehash];
+    tb->oldhash[tb->rehash++] = NULL;
     while (p) {  /* for each node in the list */
       GCObject *next = p->gch.next;  /* save next */
-      unsigned int h = gco2ts(p)->hash;
-      int h1 = lmod(h, newsize);  /* new position */
-      lua_assert(cast_int(h%newsize) == lmod(h, newsize));
-      p->gch.next = newhash[h1];  /* chain it */
-      newhash[h1] = p;
+      chainstr(tb->hash, tb->size, p);
       p = next;
     }
   }
-  luaM_freearray(L, tb->hash, tb->size, TString *);
-  tb->size = newsize;
-  tb->hash = newhash;
+  if (tb->rehash >= tb->oldsize) {  /* done? */
+    if (tb->oldhash != NULL) {
+      global_State *g = G(L);
+      lu_mem old = g->totalbytes;
+      luaM_freearray(L, tb->oldhash, tb->oldsize, TString *);
+      old -= g->totalbytes;  /* the collector does not see this memory go */
+      g->estimate -= (old < g->estimate) ? old : g->estimate;
+    }
+    tb->oldhash = NULL;
+    tb->oldsize = 0;
+  }
 }
 
 /*
- * 新建一个字符串，放到hash表中
- */
-static TString *newlstr (lua_State *L, const char *str, size_t l,
-                                       unsigned int h) {
+** Hash of all the bytes of a string, taken four at a time (MurmurHash3
+** mixing), from a seed picked at random for each state, so that keys
+** with colliding hashes cannot be prepared in advance.
+*/
+
+#define rotl(x,n)	(((x) << (n)) | ((x) >> (32 - (n))))
+
+#define mixword(h,k) { \
+  k *= 0xcc9e2d51u; k = rotl(k, 15); k *= 0x1b873593u; h ^= k; }
+
+static unsigned int hashstr (const char *str, size_t l, unsigned int seed) {
+  lu_int32 h = cast(lu_int32, seed ^ l);
+  lu_int32 k;
+  size_t l1;
+  for (l1 = l; l1 >= 4; l1 -= 4, str += 4) {
+    memcpy(&k, str, 4);
+    mixword(h, k);
+    h = rotl(h, 13);
+    h = h * 5 + 0xe6546b64u;
+  }
+  if (l1 > 0) {  /* 1 to 3 bytes left */
+    k = 0;
+    switch (l1) {
+      case 3: k ^= cast(lu_int32, cast(unsigned char, str[2])) << 16;
+      case 2: k ^= cast(lu_int32, cast(unsigned char, str[1])) << 8;
+      default: k ^= cast(unsigned char, str[0]);
+    }
+    mixword(h, k);
+  }
+  h ^= h >> 16;  /* final mix */
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35u;
+  h ^= h >> 16;
+  return cast(unsigned int, h);
+}
+
+
+/* new string with room for `l' bytes (set by the caller) */
+static TString *allocstr (lua_State *L, size_t l, unsigned int h) {
   TString *ts;
-  stringtable *tb;
   if (l+1 > (MAX_SIZET - sizeof(TString))/sizeof(char))
     luaM_toobig(L);
 
@@ -65,41 +137,252 @@ static TString *newlstr (lua_State *L, const char *str, size_t l,
   ts->tsv.marked = luaC_white(G(L));
   ts->tsv.tt = LUA_TSTRING;
   ts->tsv.reserved = 0;
-  memcpy(ts+1, str, l*sizeof(char));
+  ts->tsv.hashed = 0;
+  ts->tsv.kind = LSTRFLAT;
   ((char *)(ts+1))[l] = '\0';  /* ending 0 */
+  return ts;
+}
+
+
+static TString *createstr (lua_State *L, const char *str, size_t l,
+                                         unsigned int h) {
+  TString *ts = allocstr(L, l, h);
+  memcpy(ts+1, str, l*sizeof(char));
+  return ts;
+}
+
+/*
+ * 新建一个字符串，放到hash表中
+ */
+static TString *newlstr (lua_State *L, const char *str, size_t l,
+                                       unsigned int h) {
+  TString *ts = createstr(L, str, l, h);
   /* 去到全局的stringtable*/
-  tb = &G(L)->strt;
+  stringtable *tb = &G(L)->strt;
   h = lmod(h, tb->size);
   ts->tsv.next = tb->hash[h];  /* chain new entry */
   tb->hash[h] = obj2gco(ts);
   tb->nuse++;
-  if (tb->nuse > cast(lu_int32, tb->size) && tb->size <= MAX_INT/2)
+  if (tb->oldhash != NULL)
+    luaS_rehash(L, 2);  /* done before the new array gets crowded */
+  else if (tb->nuse > cast(lu_int32, tb->size) && tb->size <= MAX_INT/2)
     luaS_resize(L, tb->size*2);  /* too crowded */
   return ts;
 }
 
 
 TString *luaS_newlstr (lua_State *L, const char *str, size_t l) {
+  stringtable *tb;
   GCObject *o;
-  unsigned int h = cast(unsigned int, l);  /* seed */
-  size_t step = (l>>5)+1;  /* if string is too long, don't hash all its chars */
-  size_t l1;
-  for (l1=l; l1>=step; l1-=step)  /* compute hash */
-    h = h ^ ((h<<5)+(h>>2)+cast(unsigned char, str[l1-1]));
-  for (o = G(L)->strt.hash[lmod(h, G(L)->strt.size)];
-       o != NULL;
-       o = o->gch.next) {
-    TString *ts = rawgco2ts(o);
-    if (ts->tsv.len == l && (memcmp(str, getstr(ts), l) == 0)) {
-      /* string may be dead */
-      if (isdead(G(L), o)) changewhite(o);
-      return ts;
+  unsigned int h;
+  int searched = 0;
+  if (l > LUAI_MAXSHORTLEN) {  /* long string? */
+    TString *ts = createstr(L, str, l, G(L)->seed);  /* seed for its hash */
+    luaC_link(L, obj2gco(ts), LUA_TSTRING);  /* not interned */
+    return ts;
+  }
+  h = hashstr(str, l, G(L)->seed);
+  tb = &G(L)->strt;
+  o = tb->hash[lmod(h, tb->size)];
+  for (;;) {
+    for (; o != NULL; o = o->gch.next) {
+      TString *ts = rawgco2ts(o);
+      if (ts->tsv.len == l && (memcmp(str, getstr(ts), l) == 0)) {
+        /* string may be dead */
+        if (isdead(G(L), o)) changewhite(o);
+        return ts;
+      }
     }
+    if (tb->oldhash == NULL || searched++) break;
+    o = tb->oldhash[lmod(h, tb->oldsize)];  /* not moved yet? */
   }
   return newlstr(L, str, l, h);  /* not found */
 }
 
 
+/*
+** {======================================================
+** Shared buffers: `s = s .. x' appends `x' to the buffer holding `s'
+** (when `s' is its longest string), so building a string that way
+** takes linear time; the older strings remain valid prefixes of it
+** =======================================================
+*/
+
+#if defined(LUA_BGSWEEP)  /* the helper thread frees strings too */
+#define increfs(b)	__sync_add_and_fetch(&(b)->refs, 1)
+#define decrefs(b)	__sync_sub_and_fetch(&(b)->refs, 1)
+#define getrefs(b)	__sync_add_and_fetch(&(b)->refs, 0)
+#else
+#define increfs(b)	(++(b)->refs)
+#define decrefs(b)	(--(b)->refs)
+#define getrefs(b)	((b)->refs)
+#endif
+
+
+static StrBuf *newbuf (lua_State *L, size_t size) {
+  StrBuf *b;
+  if (size+1 > MAX_SIZET - sizeof(StrBuf))
+    luaM_toobig(L);
+  b = cast(StrBuf *, luaM_malloc(L, sizeof(StrBuf) + size + 1));
+  b->size = size;
+  b->used = 0;
+  b->refs = 0;
+  b->sealed = 0;
+  return b;
+}
+
+
+/* cut `ts', the only string using its buffer, down to its own bytes */
+static void trimbuf (lua_State *L, TString *ts) {
+  StrBuf *b = strbuf(ts);
+  size_t l = ts->tsv.len;
+  b = cast(StrBuf *, luaM_realloc_(L, b, sizeof(StrBuf) + b->size + 1,
+                                         sizeof(StrBuf) + l + 1));
+  b->size = l;
+  b->used = l;
+  sbufdata(b)[l] = '\0';
+  strbuf(ts) = b;
+}
+
+
+static void releasebuf (lua_State *L, StrBuf *b) {
+  if (decrefs(b) == 0)
+    luaM_freemem(L, b, sizeof(StrBuf) + b->size + 1);
+}
+
+
+/* new string with no buffer yet (so that it can be collected if
+   allocating its buffer fails) */
+static TString *bufstr (lua_State *L, size_t l) {
+  TString *ts = cast(TString *, luaM_malloc(L, sizeof(TString) +
+                                               sizeof(StrBuf *)));
+  ts->tsv.len = l;
+  ts->tsv.hash = G(L)->seed;
+  ts->tsv.reserved = 0;
+  ts->tsv.hashed = 0;
+  ts->tsv.kind = LSTRBUF;
+  strbuf(ts) = NULL;
+  luaC_link(L, obj2gco(ts), LUA_TSTRING);
+  return ts;
+}
+
+
+/* `ts' is the longest string of `b' now */
+static void usebuf (TString *ts, StrBuf *b) {
+  size_t l = ts->tsv.len;
+  strbuf(ts) = b;
+  increfs(b);
+  b->used = l;
+  sbufdata(b)[l] = '\0';
+}
+
+
+/*
+** New long string `l' bytes long that starts with the bytes of `s';
+** the caller fills the other ones, from `*rest' on. The second
+** extension in a row moves the string to a buffer just as long as it;
+** only when a string in a buffer is extended again does the new one
+** get room to grow.
+*/
+TString *luaS_concat (lua_State *L, TString *s, size_t l, char **rest) {
+  size_t sl = s->tsv.len;
+  TString *ts;
+  lua_assert(l > LUAI_MAXSHORTLEN && l >= sl);
+  if (s->tsv.kind == LSTRBUF) {
+    StrBuf *b = strbuf(s);
+    if (b->used == sl && !b->sealed && l <= b->size) {  /* append in place */
+      ts = bufstr(L, l);
+      usebuf(ts, b);
+      *rest = sbufdata(b) + sl;
+      return ts;
+    }
+  }
+  if (s->tsv.kind == LSTRFLAT) {  /* first extension */
+    ts = allocstr(L, l, G(L)->seed);
+    ts->tsv.kind = LSTRCAT;
+    luaC_link(L, obj2gco(ts), LUA_TSTRING);
+    *rest = cast(char *, ts + 1);
+  }
+  else {
+    int grow = (s->tsv.kind == LSTRBUF && l <= MAX_SIZET/4);
+    ts = bufstr(L, l);
+    usebuf(ts, newbuf(L, grow ? 2*l : l));
+    *rest = sbufdata(strbuf(ts));
+  }
+  memcpy(*rest, getstr(s), sl);
+  *rest += sl;
+  return ts;
+}
+
+
+/*
+** Make sure the bytes of `ts' are followed by a '\0' from now on:
+** keep others from appending to them (and drop the room left for
+** that, if no other string uses the buffer), or copy them to a buffer
+** of their own
+*/
+const char *luaS_seal (lua_State *L, TString *ts) {
+  StrBuf *b = strbuf(ts);
+  size_t l = ts->tsv.len;
+  lua_assert(ts->tsv.kind == LSTRBUF);
+  if (b->used == l) {
+    if (!b->sealed && b->size > l && getrefs(b) == 1)
+      trimbuf(L, ts);
+    strbuf(ts)->sealed = 1;
+  }
+  else {
+    StrBuf *nb = newbuf(L, l);
+    memcpy(sbufdata(nb), sbufdata(b), l);
+    sbufdata(nb)[l] = '\0';
+    nb->used = l;
+    nb->refs = 1;
+    nb->sealed = 1;
+    strbuf(ts) = nb;
+    releasebuf(L, b);
+  }
+  return getstr(ts);
+}
+
+
+/*
+** called by the collector for live strings in buffers: once the
+** longest string of a buffer is dead and only `ts' still uses it,
+** the buffer is cut down to the bytes of `ts'. (Those were never
+** handed out as a C string: `luaS_seal' would have copied them.)
+*/
+void luaS_trim (lua_State *L, TString *ts) {
+  StrBuf *b = strbuf(ts);
+  if (b != NULL && ts->tsv.len < b->used && getrefs(b) == 1) {
+    trimbuf(L, ts);
+    strbuf(ts)->sealed = 0;
+  }
+}
+
+
+void luaS_freestr (lua_State *L, TString *ts) {
+  if (ts->tsv.kind == LSTRBUF && strbuf(ts) != NULL)
+    releasebuf(L, strbuf(ts));
+  luaM_freemem(L, ts, sizestring(&ts->tsv));
+}
+
+/* }====================================================== */
+
+
+int luaS_eqlngstr (const TString *a, const TString *b) {
+  size_t len = a->tsv.len;
+  return (len == b->tsv.len && memcmp(getstr(a), getstr(b), len) == 0);
+}
+
+
+unsigned int luaS_hashlong (TString *ts) {
+  if (!ts->tsv.hashed) {
+    ts->tsv.hash = hashstr(getstr(ts), ts->tsv.len, ts->tsv.hash);
+    ts->tsv.hashed = 1;
+  }
+  return ts->tsv.hash;
+}
+
+
 Udata *luaS_newudata (lua_State *L, size_t s, Table *e) {
   Udata *u;
   if (s > MAX_SIZET - sizeof(Udata))
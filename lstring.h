@@ -13,7 +13,8 @@
 #include "lstate.h"
 
 
-#define sizestring(s)	(sizeof(union TString)+((s)->len+1)*sizeof(char))
+#define sizestring(s)	(sizeof(union TString)+((s)->kind == LSTRBUF ? \
+                          sizeof(StrBuf *) : ((s)->len+1)*sizeof(char)))
 
 #define sizeudata(u)	(sizeof(union Udata)+(u)->len)
 
@@ -23,7 +24,32 @@
 
 #define luaS_fix(s)	l_setbit((s)->tsv.marked, FIXEDBIT)
 
+/*
+** strings longer than LUAI_MAXSHORTLEN are not interned, so two of
+** them may be equal without being the same object; their hash is
+** only computed when needed
+*/
+#define islong(ts)	((ts)->tsv.len > LUAI_MAXSHORTLEN)
+
+#define luaS_eqstr(a,b)	((a) == (b) || (islong(a) && luaS_eqlngstr(a, b)))
+
+#define luaS_hash(ts)	(islong(ts) ? luaS_hashlong(ts) : (ts)->tsv.hash)
+
+/*
+** bytes of a string followed by a '\0', as a C string needs them (only
+** the longest string of a `StrBuf' has it there)
+*/
+#define luaS_cstr(L,ts)	((ts)->tsv.kind == LSTRBUF ? luaS_seal(L, ts) : getstr(ts))
+
+LUAI_FUNC TString *luaS_concat (lua_State *L, TString *s, size_t l,
+                                char **rest);
+LUAI_FUNC const char *luaS_seal (lua_State *L, TString *ts);
+LUAI_FUNC void luaS_trim (lua_State *L, TString *ts);
+LUAI_FUNC void luaS_freestr (lua_State *L, TString *ts);
+LUAI_FUNC int luaS_eqlngstr (const TString *a, const TString *b);
+LUAI_FUNC unsigned int luaS_hashlong (TString *ts);
 LUAI_FUNC void luaS_resize (lua_State *L, int newsize);
+LUAI_FUNC void luaS_rehash (lua_State *L, int n);
 LUAI_FUNC Udata *luaS_newudata (lua_State *L, size_t s, Table *e);
 LUAI_FUNC TString *luaS_newlstr (lua_State *L, const char *str, size_t l);
 
@@ -6,6 +6,7 @@
 
 
 #include <ctype.h>
+#include <locale.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -168,6 +169,195 @@ static int str_dump (lua_State *L) {
 
 
 
+/*
+** {======================================================
+** Substring search
+** =======================================================
+*/
+
+/*
+** Candidates are positions whose first and last bytes match those of
+** the needle, found 16 or 32 at a time where the machine can; each is
+** then checked with `memcmp'. If checking costs more than LMEMWORK
+** times the bytes scanned so far (as with "aaa...ab" in "aaa..."),
+** the rest is left to the Two-Way algorithm, which is linear in the
+** worst case.
+*/
+
+#define LMEMWORK	4
+
+#define toomuchwork(work,s,s1)	((work) > LMEMWORK * (size_t)((s) - (s1)) + 256)
+
+
+/*
+** Two-Way string matching (Crochemore & Perrin, 1991), with a table of
+** shifts on the last byte of the window
+*/
+static const char *twoway (const unsigned char *h, size_t lh,
+                           const unsigned char *n, size_t l) {
+  const unsigned char *z = h + lh;
+  size_t i, ip, jp, k, p, ms, p0, mem, mem0;
+  size_t shift[256];
+  unsigned char inneedle[256];
+  memset(inneedle, 0, sizeof(inneedle));
+  for (i = 0; i < l; i++) {
+    inneedle[n[i]] = 1;
+    shift[n[i]] = i+1;
+  }
+  /* maximal suffix of the needle */
+  ip = (size_t)-1; jp = 0; k = p = 1;
+  while (jp+k < l) {
+    if (n[ip+k] == n[jp+k]) {
+      if (k == p) { jp += p; k = 1; }
+      else k++;
+    }
+    else if (n[ip+k] > n[jp+k]) { jp += k; k = 1; p = jp - ip; }
+    else { ip = jp++; k = p = 1; }
+  }
+  ms = ip;
+  p0 = p;
+  /* ... and with the opposite order */
+  ip = (size_t)-1; jp = 0; k = p = 1;
+  while (jp+k < l) {
+    if (n[ip+k] == n[jp+k]) {
+      if (k == p) { jp += p; k = 1; }
+      else k++;
+    }
+    else if (n[ip+k] < n[jp+k]) { jp += k; k = 1; p = jp - ip; }
+    else { ip = jp++; k = p = 1; }
+  }
+  if (ip+1 > ms+1) ms = ip;  /* critical factorization */
+  else p = p0;
+  if (memcmp(n, n+p, ms+1) != 0) {  /* not periodic? */
+    mem0 = 0;
+    p = ((ms > l-ms-1) ? ms : l-ms-1) + 1;
+  }
+  else mem0 = l-p;
+  mem = 0;
+  for (;;) {
+    if ((size_t)(z-h) < l) return NULL;
+    if (inneedle[h[l-1]]) {  /* last byte of the window is in the needle */
+      k = l - shift[h[l-1]];
+      if (k) {
+        if (k < mem) k = mem;
+        h += k; mem = 0;
+        continue;
+      }
+    }
+    else {
+      h += l; mem = 0;
+      continue;
+    }
+    /* compare right half */
+    for (k = (ms+1 > mem) ? ms+1 : mem; k < l && n[k] == h[k]; k++) ;
+    if (k < l) {
+      h += k-ms; mem = 0;
+      continue;
+    }
+    /* compare left half */
+    for (k = ms+1; k > mem && n[k-1] == h[k-1]; k--) ;
+    if (k <= mem) return (const char *)h;
+    h += p; mem = mem0;
+  }
+}
+
+
+#if defined(LUA_USE_SIMDFIND)
+
+#include <immintrin.h>
+
+/* search for `s2' (l2 >= 2) from `*ps' while a 16-byte block fits */
+static const char *find_sse2 (const char **ps, const char *e,
+                              const char *s2, size_t l2, size_t *work) {
+  const char *s = *ps;
+  const char *s1 = s;
+  const __m128i first = _mm_set1_epi8(s2[0]);
+  const __m128i last = _mm_set1_epi8(s2[l2-1]);
+  for (; e - s >= (ptrdiff_t)(l2 + 15); s += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)s);
+    __m128i b = _mm_loadu_si128((const __m128i *)(s + l2 - 1));
+    unsigned int mask = (unsigned int)_mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+    while (mask != 0) {
+      int i = __builtin_ctz(mask);
+      if (memcmp(s + i + 1, s2 + 1, l2 - 2) == 0)
+        return s + i;
+      *work += l2;
+      mask &= mask - 1;
+    }
+    if (toomuchwork(*work, s, s1)) break;
+  }
+  *ps = s;
+  return NULL;
+}
+
+
+__attribute__((target("avx2")))
+static const char *find_avx2 (const char **ps, const char *e,
+                              const char *s2, size_t l2, size_t *work) {
+  const char *s = *ps;
+  const char *s1 = s;
+  const __m256i first = _mm256_set1_epi8(s2[0]);
+  const __m256i last = _mm256_set1_epi8(s2[l2-1]);
+  for (; e - s >= (ptrdiff_t)(l2 + 31); s += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)s);
+    __m256i b = _mm256_loadu_si256((const __m256i *)(s + l2 - 1));
+    unsigned int mask = (unsigned int)_mm256_movemask_epi8(
+        _mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+                         _mm256_cmpeq_epi8(b, last)));
+    while (mask != 0) {
+      int i = __builtin_ctz(mask);
+      if (memcmp(s + i + 1, s2 + 1, l2 - 2) == 0)
+        return s + i;
+      *work += l2;
+      mask &= mask - 1;
+    }
+    if (toomuchwork(*work, s, s1)) break;
+  }
+  *ps = s;
+  return NULL;
+}
+
+#endif
+
+
+static const char *lmemfind (const char *s1, size_t l1,
+                               const char *s2, size_t l2) {
+  if (l2 == 0) return s1;  /* empty strings are everywhere */
+  else if (l2 > l1) return NULL;  /* avoids a negative `l1' */
+  else if (l2 == 1) return (const char *)memchr(s1, *s2, l1);
+  else {
+    const char *s = s1;
+    const char *e = s1 + l1;
+    const char *init;
+    size_t work = 0;  /* bytes compared on false candidates */
+#if defined(LUA_USE_SIMDFIND)
+    if (__builtin_cpu_supports("avx2"))
+      init = find_avx2(&s, e, s2, l2, &work);
+    else
+      init = find_sse2(&s, e, s2, l2, &work);
+    if (init != NULL) return init;
+#endif
+    for (;;) {  /* `memchr' for the 1st char, then check the rest */
+      if ((size_t)(e - s) < l2)
+        return NULL;  /* not found */
+      if (toomuchwork(work, s, s1))
+        return twoway((const unsigned char *)s, e - s,
+                      (const unsigned char *)s2, l2);
+      init = (const char *)memchr(s, *s2, (e - s) - (l2 - 1));
+      if (init == NULL)
+        return NULL;
+      if (memcmp(init+1, s2+1, l2-1) == 0)
+        return init;
+      work += l2;
+      s = init+1;
+    }
+  }
+}
+
+/* }====================================================== */
+
+
 /*
 ** {======================================================
 ** PATTERN MATCHING
@@ -175,13 +365,90 @@ static int str_dump (lua_State *L) {
 */
 
 
+/*
+** A pattern is compiled once into an array of items, each single-char
+** class becoming a 256-bit set, and kept in a small per-state cache of
+** the most recently used patterns. Matching backtracks over the items
+** as the interpreter used to over the pattern source; once a match has
+** taken too many steps it starts recording the (item, position) pairs
+** it has tried. A pair tried once failed (items only move forward, so
+** no pair is tried inside itself), so it is never tried again. A
+** repetition that fails also marks the later pairs of its item in the
+** same run, whose tries are a subset of its own, and stops expanding at
+** the first pair already marked; so each pair is reached O(1) times and
+** the whole search is linear in the subject unless the pattern has back
+** references (whose success depends on the captures) or `%b' items.
+*/
+
+
 #define CAP_UNFINISHED	(-1)
 #define CAP_POSITION	(-2)
 
+
+/* item operations */
+#define PI_SINGLE	0  /* single-char class, with a repetition */
+#define PI_OPEN		1  /* start of capture */
+#define PI_POSCAP	2  /* position capture */
+#define PI_CLOSE	3  /* end of capture */
+#define PI_BALANCE	4  /* %bxy */
+#define PI_FRONTIER	5  /* %f[set] */
+#define PI_BACKREF	6  /* %1-%9 */
+#define PI_EOS		7  /* `$' at the end of the pattern */
+#define PI_END		8  /* end of the pattern */
+#define PI_ERROR	9  /* malformed pattern; raised only if reached */
+
+/* repetitions of a single-char class */
+#define PR_ONE		0
+#define PR_OPT		1  /* `?' */
+#define PR_MAX		2  /* `*' */
+#define PR_MAX1		3  /* `+' */
+#define PR_MIN		4  /* `-' */
+
+#define PATSETSIZE	(256/8)
+
+typedef struct PatItem {
+  unsigned char op;
+  unsigned char rep;
+  unsigned char c1, c2;  /* %b delimiters, capture digit or error index */
+  unsigned char set[PATSETSIZE];  /* characters matched by the class */
+} PatItem;
+
+#define inset(it,c)	((it)->set[(c) >> 3] & (1 << ((c) & 7)))
+
+typedef struct Pattern {
+  int n;  /* number of items */
+  int ctype;  /* does it use locale-dependent classes? */
+  int backref;  /* does it use back references? */
+  size_t len;
+  const char *src;  /* copy of the source, for the cache lookup */
+  size_t plen;
+  const char *prefix;  /* literal text every match starts with */
+  PatItem item[1];
+} Pattern;
+
+
+typedef struct PatCache {
+  int n;  /* number of patterns in use */
+  struct {
+    Pattern *p;
+    int ref;  /* reference to its userdata in the registry */
+  } slot[LUAI_PATCACHE];  /* most recently used first */
+  unsigned char *memo;  /* visited states of the current match */
+  size_t memosize;
+  unsigned int gen;  /* changes whenever `memo' is handed out */
+  char locale[64];  /* LC_CTYPE for the classes of the cached patterns */
+} PatCache;
+
+
 typedef struct MatchState {
   const char *src_init;  /* init of source string */
   const char *src_end;  /* end (`\0') of source string */
   lua_State *L;
+  const Pattern *pat;
+  PatCache *cache;
+  unsigned char *memo;  /* visited (item, position) pairs, or NULL */
+  size_t steps;  /* steps left before `memo' is set up */
+  unsigned int gen;  /* `cache->gen' when `memo' was set up */
   int level;  /* total number of captures (finished or unfinished) */
   struct {
     const char *init;
@@ -193,6 +460,20 @@ typedef struct MatchState {
 #define L_ESC		'%'
 #define SPECIALS	"^$*+?.([%-"
 
+/* steps per subject char a match may take before recording states */
+#define MEMOSTEPS	8
+
+/* largest `memo' (in bytes) kept from one search to the next */
+#define MEMOKEEP	4096
+
+
+static const char *const paterrors[] = {
+  "malformed pattern (ends with " LUA_QL("%%") ")",
+  "malformed pattern (missing " LUA_QL("]") ")",
+  "missing " LUA_QL("[") " after " LUA_QL("%%f") " in pattern",
+  "unbalanced pattern"
+};
+
 
 static int check_capture (MatchState *ms, int l) {
   l -= '1';
@@ -210,18 +491,19 @@ static int capture_to_close (MatchState *ms) {
 }
 
 
-static const char *classend (MatchState *ms, const char *p) {
+/* returns NULL for a malformed class */
+static const char *classend (const char *p) {
   switch (*p++) {
     case L_ESC: {
       if (*p == '\0')
-        luaL_error(ms->L, "malformed pattern (ends with " LUA_QL("%%") ")");
+        return NULL;
       return p+1;
     }
     case '[': {
       if (*p == '^') p++;
       do {  /* look for a `]' */
         if (*p == '\0')
-          luaL_error(ms->L, "malformed pattern (missing " LUA_QL("]") ")");
+          return NULL;
         if (*(p++) == L_ESC && *p != '\0')
           p++;  /* skip escapes (e.g. `%]') */
       } while (*p != ']');
@@ -286,77 +568,438 @@ static int singlematch (int c, const char *p, const char *ep) {
 }
 
 
-static const char *match (MatchState *ms, const char *s, const char *p);
+/* fill the set of item `it' with the class [p, ep) */
+static void setclass (Pattern *pat, PatItem *it, const char *p,
+                      const char *ep, int bracket) {
+  const char *q;
+  int c;
+  memset(it->set, 0, PATSETSIZE);
+  for (c = 0; c < 256; c++) {
+    if (bracket ? matchbracketclass(c, p, ep-1) : singlematch(c, p, ep))
+      it->set[c >> 3] |= (unsigned char)(1 << (c & 7));
+  }
+  for (q = p; q < ep - 1; q++) {  /* any class that depends on the locale? */
+    if (*q == L_ESC) {
+      if (isalpha(uchar(*(q+1))) && tolower(uchar(*(q+1))) != 'z')
+        pat->ctype = 1;
+      q++;
+    }
+  }
+}
+
+
+/* returns the only char in the set of `it', or -1 */
+static int onlychar (const PatItem *it) {
+  int c, res = -1;
+  for (c = 0; c < 256; c++) {
+    if (inset(it, c)) {
+      if (res >= 0) return -1;
+      res = c;
+    }
+  }
+  return res;
+}
+
+
+/*
+** literal text a match must start with: leading chars and, before
+** them, captures that cannot fail or raise errors
+*/
+static size_t litprefix (const Pattern *pat, char *buff) {
+  const PatItem *it;
+  size_t n = 0;
+  int level = 0, open = 0;
+  for (it = pat->item; ; it++) {
+    int c;
+    if (it->op == PI_SINGLE && (c = onlychar(it)) >= 0) {
+      if (it->rep == PR_ONE || it->rep == PR_MAX1)
+        buff[n++] = (char)c;
+      if (it->rep != PR_ONE) break;
+    }
+    else if ((it->op == PI_OPEN || it->op == PI_POSCAP) &&
+             level < LUA_MAXCAPTURES) {
+      level++;
+      if (it->op == PI_OPEN) open++;
+    }
+    else if (it->op == PI_CLOSE && open > 0)
+      open--;
+    else break;
+  }
+  return n;
+}
+
+
+/*
+** compile the pattern [p, p+l) into a new userdata on the stack; errors
+** in the pattern become PI_ERROR items, so that they are raised only
+** when a match reaches them, as before
+*/
+static Pattern *compile (lua_State *L, const char *p, size_t l) {
+  Pattern *pat = (Pattern *)lua_newuserdata(L, sizeof(Pattern) +
+                                    l * sizeof(PatItem) + 2 * (l + 1));
+  PatItem *it = pat->item;
+  char *src = (char *)(pat->item + l + 1);  /* at most l+1 items */
+  memcpy(src, p, l);
+  src[l] = '\0';
+  pat->ctype = pat->backref = 0;
+  pat->len = l;
+  pat->src = p = src;
+  for (;; it++) {
+    const char *ep;
+    it->rep = PR_ONE;
+    switch (*p) {
+      case '(': {
+        if (*(p+1) == ')') {  /* position capture? */
+          it->op = PI_POSCAP; p += 2;
+        }
+        else {
+          it->op = PI_OPEN; p++;
+        }
+        continue;
+      }
+      case ')': {
+        it->op = PI_CLOSE; p++;
+        continue;
+      }
+      case '\0': {
+        it->op = PI_END;
+        break;
+      }
+      case '$': {
+        if (*(p+1) == '\0') {  /* is the `$' the last char in pattern? */
+          it->op = PI_EOS;
+          break;
+        }
+        goto dflt;
+      }
+      case L_ESC: {
+        switch (*(p+1)) {
+          case 'b': {  /* balanced string? */
+            if (*(p+2) == '\0' || *(p+3) == '\0') {
+              it->op = PI_ERROR; it->c1 = 3;
+              break;
+            }
+            it->op = PI_BALANCE;
+            it->c1 = uchar(*(p+2)); it->c2 = uchar(*(p+3));
+            p += 4;
+            continue;
+          }
+          case 'f': {  /* frontier? */
+            p += 2;
+            if (*p != '[') {
+              it->op = PI_ERROR; it->c1 = 2;
+              break;
+            }
+            if ((ep = classend(p)) == NULL) {
+              it->op = PI_ERROR; it->c1 = 1;
+              break;
+            }
+            it->op = PI_FRONTIER;
+            setclass(pat, it, p, ep, 1);
+            p = ep;
+            continue;
+          }
+          default: {
+            if (isdigit(uchar(*(p+1)))) {  /* capture results (%0-%9)? */
+              it->op = PI_BACKREF;
+              it->c1 = uchar(*(p+1));
+              pat->backref = 1;
+              p += 2;
+              continue;
+            }
+            goto dflt;
+          }
+        }
+        break;
+      }
+      default: dflt: {  /* it is a pattern item */
+        if ((ep = classend(p)) == NULL) {
+          it->op = PI_ERROR; it->c1 = (*p == L_ESC) ? 0 : 1;
+          break;
+        }
+        it->op = PI_SINGLE;
+        setclass(pat, it, p, ep, 0);
+        switch (*ep) {
+          case '?': it->rep = PR_OPT; ep++; break;
+          case '*': it->rep = PR_MAX; ep++; break;
+          case '+': it->rep = PR_MAX1; ep++; break;
+          case '-': it->rep = PR_MIN; ep++; break;
+          default: break;
+        }
+        p = ep;
+        continue;
+      }
+    }
+    break;  /* last item */
+  }
+  pat->n = (int)(it - pat->item) + 1;
+  pat->prefix = src + l + 1;
+  pat->plen = litprefix(pat, src + l + 1);
+  return pat;
+}
+
+
+static void flushcache (lua_State *L, PatCache *pc) {
+  while (pc->n > 0)
+    luaL_unref(L, LUA_REGISTRYINDEX, pc->slot[--pc->n].ref);
+}
+
+
+/* are the cached classes good for the current locale? (flush if not) */
+static int samelocale (lua_State *L, PatCache *pc) {
+  const char *loc = setlocale(LC_CTYPE, NULL);
+  if (loc != NULL && strcmp(loc, pc->locale) == 0)
+    return 1;
+  flushcache(L, pc);
+  if (loc != NULL && strlen(loc) < sizeof(pc->locale))
+    strcpy(pc->locale, loc);
+  else
+    pc->locale[0] = '\0';  /* matches no locale name */
+  return 0;
+}
+
+
+/* push the compiled form of pattern [p, p+l) */
+static Pattern *getpattern (lua_State *L, const char *p, size_t l) {
+  PatCache *pc = (PatCache *)lua_touserdata(L, lua_upvalueindex(1));
+  Pattern *pat;
+  int i;
+  for (i = 0; i < pc->n; i++) {
+    pat = pc->slot[i].p;
+    if (pat->len == l && memcmp(pat->src, p, l) == 0) {
+      if (pat->ctype && !samelocale(L, pc))
+        break;  /* cache flushed */
+      if (i > 0) {  /* move it to the front */
+        int ref = pc->slot[i].ref;
+        memmove(&pc->slot[1], &pc->slot[0], i * sizeof(pc->slot[0]));
+        pc->slot[0].p = pat;
+        pc->slot[0].ref = ref;
+      }
+      lua_rawgeti(L, LUA_REGISTRYINDEX, pc->slot[0].ref);
+      return pat;
+    }
+  }
+  pat = compile(L, p, l);
+  if (pat->ctype) samelocale(L, pc);
+  if (pc->n == LUAI_PATCACHE)  /* cache full? */
+    luaL_unref(L, LUA_REGISTRYINDEX, pc->slot[--pc->n].ref);  /* drop LRU */
+  memmove(&pc->slot[1], &pc->slot[0], pc->n * sizeof(pc->slot[0]));
+  lua_pushvalue(L, -1);
+  pc->slot[0].ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  pc->slot[0].p = pat;
+  pc->n++;
+  return pat;
+}
+
+
+static void freememo (lua_State *L, PatCache *pc) {
+  void *ud;
+  lua_Alloc allocf = lua_getallocf(L, &ud);
+  allocf(ud, pc->memo, pc->memosize, 0);
+  pc->memo = NULL;
+  pc->memosize = 0;
+  pc->gen++;  /* any match still holding it must let it go */
+}
+
+
+static int cache_gc (lua_State *L) {
+  freememo(L, (PatCache *)lua_touserdata(L, 1));
+  return 0;
+}
+
+
+static void prepstate (MatchState *ms, lua_State *L, const char *s, size_t l,
+                       const Pattern *pat, PatCache *pc) {
+  ms->L = L;
+  ms->src_init = s;
+  ms->src_end = s+l;
+  ms->pat = pat;
+  ms->cache = pc;
+  ms->memo = NULL;
+  ms->steps = pat->backref ? ~(size_t)0 : MEMOSTEPS * (l + 1);
+}
+
+
+/*
+** a search is over: the collector does not see `memo', so do not keep
+** a large one for the next search
+*/
+static void endsearch (MatchState *ms) {
+  if (ms->cache->memosize > MEMOKEEP)
+    freememo(ms->L, ms->cache);
+}
+
+
+/* start recording visited states */
+static void startmemo (MatchState *ms) {
+  PatCache *pc = ms->cache;
+  size_t n = (size_t)(ms->src_end - ms->src_init) + 1;
+  size_t size;
+  ms->steps = ~(size_t)0;  /* do not come back here */
+  if (n > (~(size_t)0 - 7) / ms->pat->n) return;  /* too large */
+  size = (n * ms->pat->n + 7) / 8;
+  if (size > pc->memosize) {
+    void *ud;
+    lua_Alloc allocf = lua_getallocf(ms->L, &ud);
+    unsigned char *nm = (unsigned char *)allocf(ud, pc->memo,
+                                                pc->memosize, size);
+    if (nm == NULL) return;  /* no memory: go on without it */
+    pc->memo = nm;
+    pc->memosize = size;
+  }
+  memset(pc->memo, 0, size);
+  ms->memo = pc->memo;
+  ms->gen = ++pc->gen;
+}
+
+
+#define stateindex(ms,s,it) \
+	((size_t)((s) - (ms)->src_init) * (ms)->pat->n + ((it) - (ms)->pat->item))
+
+#define visited(ms,s,it) \
+	((ms)->memo[stateindex(ms,s,it) >> 3] & (1 << (stateindex(ms,s,it) & 7)))
+
+
+/* mark state (s, it); returns 0 if it was tried before */
+static int visit (MatchState *ms, const char *s, const PatItem *it) {
+  if (ms->memo != NULL) {
+    size_t i = stateindex(ms, s, it);
+    if (ms->memo[i >> 3] & (1 << (i & 7)))
+      return 0;
+    ms->memo[i >> 3] |= (unsigned char)(1 << (i & 7));
+  }
+  else if (ms->steps-- == 0)
+    startmemo(ms);
+  return 1;
+}
+
+
+/*
+** a repetition at `s' tries a subset of what the same item tried at
+** `s-1' if that char is in its class
+*/
+#define triedrun(ms,s,it) ((ms)->memo != NULL && (s) > (ms)->src_init && \
+	inset(it, uchar(*((s)-1))) && visited(ms, (s)-1, it))
+
+
+/* mark states `s'..`e' of `it' as tried */
+static void marktried (MatchState *ms, const char *s, const char *e,
+                       const PatItem *it) {
+  if (ms->memo == NULL) return;
+  for (; s <= e; s++) {
+    size_t i = stateindex(ms, s, it);
+    ms->memo[i >> 3] |= (unsigned char)(1 << (i & 7));
+  }
+}
+
+
+/*
+** after a match, states from `s' to `e' may have succeeded; forget
+** them (and all of `memo' if someone else took it meanwhile)
+*/
+static void clearmemo (MatchState *ms, const char *s, const char *e) {
+  if (ms->memo == NULL) return;
+  else if (ms->gen != ms->cache->gen) {
+    ms->memo = NULL;
+    ms->steps = MEMOSTEPS * (size_t)(ms->src_end - ms->src_init + 1);
+  }
+  else {
+    size_t i = stateindex(ms, s, ms->pat->item);
+    size_t j = stateindex(ms, e, ms->pat->item) + ms->pat->n;
+    for (; i < j; i++)
+      ms->memo[i >> 3] &= (unsigned char)~(1 << (i & 7));
+  }
+}
+
+
+static const char *match (MatchState *ms, const char *s, const PatItem *it);
 
 
 static const char *matchbalance (MatchState *ms, const char *s,
-                                   const char *p) {
-  if (*p == 0 || *(p+1) == 0)
-    luaL_error(ms->L, "unbalanced pattern");
-  if (*s != *p) return NULL;
+                                   const PatItem *it) {
+  if (s >= ms->src_end || uchar(*s) != it->c1) return NULL;
   else {
-    int b = *p;
-    int e = *(p+1);
+    int b = it->c1;
+    int e = it->c2;
     int cont = 1;
     while (++s < ms->src_end) {
-      if (*s == e) {
+      if (uchar(*s) == e) {
         if (--cont == 0) return s+1;
       }
-      else if (*s == b) cont++;
+      else if (uchar(*s) == b) cont++;
     }
   }
   return NULL;  /* string ends out of balance */
 }
 
 
+/*
+** repetitions of `it' from `s'; the state of `it' that tries to go on
+** from `s+i' onwards is at `s+i-off' (`off' is 1 for `+', 0 otherwise),
+** so once that one is marked the rest has been tried
+*/
+#define runtried(ms,s,i,it,off) \
+	((ms)->memo != NULL && visited(ms, (s)+(i)-(off), it))
+
+
 static const char *max_expand (MatchState *ms, const char *s,
-                                 const char *p, const char *ep) {
+                                 const PatItem *it, int off) {
   ptrdiff_t i = 0;  /* counts maximum expand for item */
-  while ((s+i)<ms->src_end && singlematch(uchar(*(s+i)), p, ep))
+  ptrdiff_t n;
+  while ((s+i)<ms->src_end && inset(it, uchar(*(s+i)))) {
     i++;
+    if (runtried(ms, s, i, it, off)) {  /* rest of the run tried? */
+      i--;
+      break;
+    }
+  }
   /* keeps trying to match with the maximum repetitions */
-  while (i>=0) {
-    const char *res = match(ms, (s+i), ep+1);
+  for (n = i; n >= 0; n--) {
+    const char *res = match(ms, (s+n), it+1);
     if (res) return res;
-    i--;  /* else didn't match; reduce 1 repetition to try again */
   }
+  marktried(ms, s+1-off, s+i-off, it);  /* they would try less */
   return NULL;
 }
 
 
 static const char *min_expand (MatchState *ms, const char *s,
-                                 const char *p, const char *ep) {
+                                 const PatItem *it) {
+  const char *init = s;
   for (;;) {
-    const char *res = match(ms, s, ep+1);
+    const char *res = match(ms, s, it+1);
     if (res != NULL)
       return res;
-    else if (s<ms->src_end && singlematch(uchar(*s), p, ep))
+    else if (s<ms->src_end && inset(it, uchar(*s)) &&
+             !runtried(ms, s, 1, it, 0))
       s++;  /* try with one more repetition */
-    else return NULL;
+    else break;
   }
+  marktried(ms, init+1, s, it);  /* they would try less */
+  return NULL;
 }
 
 
 static const char *start_capture (MatchState *ms, const char *s,
-                                    const char *p, int what) {
+                                    const PatItem *it, int what) {
   const char *res;
   int level = ms->level;
   if (level >= LUA_MAXCAPTURES) luaL_error(ms->L, "too many captures");
   ms->capture[level].init = s;
   ms->capture[level].len = what;
   ms->level = level+1;
-  if ((res=match(ms, s, p)) == NULL)  /* match failed? */
+  if ((res=match(ms, s, it)) == NULL)  /* match failed? */
     ms->level--;  /* undo capture */
   return res;
 }
 
 
 static const char *end_capture (MatchState *ms, const char *s,
-                                  const char *p) {
+                                  const PatItem *it) {
   int l = capture_to_close(ms);
   const char *res;
   ms->capture[l].len = s - ms->capture[l].init;  /* close capture */
-  if ((res = match(ms, s, p)) == NULL)  /* match failed? */
+  if ((res = match(ms, s, it)) == NULL)  /* match failed? */
     ms->capture[l].len = CAP_UNFINISHED;  /* undo capture */
   return res;
 }
@@ -373,77 +1016,67 @@ static const char *match_capture (MatchState *ms, const char *s, int l) {
 }
 
 
-static const char *match (MatchState *ms, const char *s, const char *p) {
+static const char *match (MatchState *ms, const char *s, const PatItem *it) {
   init: /* using goto's to optimize tail recursion */
-  switch (*p) {
-    case '(': {  /* start capture */
-      if (*(p+1) == ')')  /* position capture? */
-        return start_capture(ms, s, p+2, CAP_POSITION);
-      else
-        return start_capture(ms, s, p+1, CAP_UNFINISHED);
+  if (!visit(ms, s, it)) return NULL;  /* already failed from here */
+  switch (it->op) {
+    case PI_OPEN: {  /* start capture */
+      return start_capture(ms, s, it+1, CAP_UNFINISHED);
     }
-    case ')': {  /* end capture */
-      return end_capture(ms, s, p+1);
+    case PI_POSCAP: {  /* position capture */
+      return start_capture(ms, s, it+1, CAP_POSITION);
     }
-    case L_ESC: {
-      switch (*(p+1)) {
-        case 'b': {  /* balanced string? */
-          s = matchbalance(ms, s, p+2);
-          if (s == NULL) return NULL;
-          p+=4; goto init;  /* else return match(ms, s, p+4); */
-        }
-        case 'f': {  /* frontier? */
-          const char *ep; char previous;
-          p += 2;
-          if (*p != '[')
-            luaL_error(ms->L, "missing " LUA_QL("[") " after "
-                               LUA_QL("%%f") " in pattern");
-          ep = classend(ms, p);  /* points to what is next */
-          previous = (s == ms->src_init) ? '\0' : *(s-1);
-          if (matchbracketclass(uchar(previous), p, ep-1) ||
-             !matchbracketclass(uchar(*s), p, ep-1)) return NULL;
-          p=ep; goto init;  /* else return match(ms, s, ep); */
-        }
-        default: {
-          if (isdigit(uchar(*(p+1)))) {  /* capture results (%0-%9)? */
-            s = match_capture(ms, s, uchar(*(p+1)));
-            if (s == NULL) return NULL;
-            p+=2; goto init;  /* else return match(ms, s, p+2) */
-          }
-          goto dflt;  /* case default */
-        }
-      }
+    case PI_CLOSE: {  /* end capture */
+      return end_capture(ms, s, it+1);
     }
-    case '\0': {  /* end of pattern */
+    case PI_BALANCE: {  /* balanced string */
+      s = matchbalance(ms, s, it);
+      if (s == NULL) return NULL;
+      it++; goto init;  /* else return match(ms, s, it+1); */
+    }
+    case PI_FRONTIER: {
+      int previous = (s == ms->src_init) ? '\0' : uchar(*(s-1));
+      int current = (s < ms->src_end) ? uchar(*s) : '\0';
+      if (inset(it, previous) || !inset(it, current)) return NULL;
+      it++; goto init;  /* else return match(ms, s, it+1); */
+    }
+    case PI_BACKREF: {  /* capture results (%0-%9) */
+      s = match_capture(ms, s, it->c1);
+      if (s == NULL) return NULL;
+      it++; goto init;  /* else return match(ms, s, it+1) */
+    }
+    case PI_END: {  /* end of pattern */
       return s;  /* match succeeded */
     }
-    case '$': {
-      if (*(p+1) == '\0')  /* is the `$' the last char in pattern? */
-        return (s == ms->src_end) ? s : NULL;  /* check end of string */
-      else goto dflt;
+    case PI_EOS: {  /* check end of string */
+      return (s == ms->src_end) ? s : NULL;
     }
-    default: dflt: {  /* it is a pattern item */
-      const char *ep = classend(ms, p);  /* points to what is next */
-      int m = s<ms->src_end && singlematch(uchar(*s), p, ep);
-      switch (*ep) {
-        case '?': {  /* optional */
+    case PI_ERROR: {
+      luaL_error(ms->L, paterrors[it->c1]);
+      return NULL;
+    }
+    default: {  /* single-char class */
+      int m = s<ms->src_end && inset(it, uchar(*s));
+      switch (it->rep) {
+        case PR_OPT: {  /* optional */
           const char *res;
-          if (m && ((res=match(ms, s+1, ep+1)) != NULL))
+          if (m && ((res=match(ms, s+1, it+1)) != NULL))
             return res;
-          p=ep+1; goto init;  /* else return match(ms, s, ep+1); */
+          it++; goto init;  /* else return match(ms, s, it+1); */
         }
-        case '*': {  /* 0 or more repetitions */
-          return max_expand(ms, s, p, ep);
+        case PR_MAX: {  /* 0 or more repetitions */
+          return triedrun(ms, s, it) ? NULL : max_expand(ms, s, it, 0);
         }
-        case '+': {  /* 1 or more repetitions */
-          return (m ? max_expand(ms, s+1, p, ep) : NULL);
+        case PR_MAX1: {  /* 1 or more repetitions */
+          return (m && !triedrun(ms, s, it)) ? max_expand(ms, s+1, it, 1)
+                                             : NULL;
         }
-        case '-': {  /* 0 or more repetitions (minimum) */
-          return min_expand(ms, s, p, ep);
+        case PR_MIN: {  /* 0 or more repetitions (minimum) */
+          return triedrun(ms, s, it) ? NULL : min_expand(ms, s, it);
         }
         default: {
           if (!m) return NULL;
-          s++; p=ep; goto init;  /* else return match(ms, s+1, ep); */
+          s++; it++; goto init;  /* else return match(ms, s+1, it+1); */
         }
       }
     }
@@ -452,28 +1085,6 @@ static const char *match (MatchState *ms, const char *s, const char *p) {
 
 
 
-static const char *lmemfind (const char *s1, size_t l1,
-                               const char *s2, size_t l2) {
-  if (l2 == 0) return s1;  /* empty strings are everywhere */
-  else if (l2 > l1) return NULL;  /* avoids a negative `l1' */
-  else {
-    const char *init;  /* to search for a `*s2' inside `s1' */
-    l2--;  /* 1st char will be checked by `memchr' */
-    l1 = l1-l2;  /* `s2' cannot be found after that */
-    while (l1 > 0 && (init = (const char *)memchr(s1, *s2, l1)) != NULL) {
-      init++;   /* 1st char is already checked */
-      if (memcmp(init, s2+1, l2) == 0)
-        return init-1;
-      else {  /* correct `l1' and `s1' to try again */
-        l1 -= init-s1;
-        s1 = init;
-      }
-    }
-    return NULL;  /* not found */
-  }
-}
-
-
 static void push_onecapture (MatchState *ms, int i, const char *s,
                                                     const char *e) {
   if (i >= ms->level) {
@@ -522,15 +1133,20 @@ static int str_find_aux (lua_State *L, int find) {
   }
   else {
     MatchState ms;
-    int anchor = (*p == '^') ? (p++, 1) : 0;
+    int anchor = (*p == '^');
+    const Pattern *pat = getpattern(L, p + anchor, l2 - anchor);
+    PatCache *pc = (PatCache *)lua_touserdata(L, lua_upvalueindex(1));
     const char *s1=s+init;
-    ms.L = L;
-    ms.src_init = s;
-    ms.src_end = s+l1;
+    prepstate(&ms, L, s, l1, pat, pc);
     do {
       const char *res;
+      if (pat->plen > 0 && !anchor) {  /* skip to its literal prefix */
+        s1 = lmemfind(s1, ms.src_end - s1, pat->prefix, pat->plen);
+        if (s1 == NULL) break;
+      }
       ms.level = 0;
-      if ((res=match(&ms, s1, p)) != NULL) {
+      if ((res=match(&ms, s1, pat->item)) != NULL) {
+        endsearch(&ms);
         if (find) {
           lua_pushinteger(L, s1-s+1);  /* start */
           lua_pushinteger(L, res-s);   /* end */
@@ -540,6 +1156,7 @@ static int str_find_aux (lua_State *L, int find) {
           return push_captures(&ms, s1, res);
       }
     } while (s1++ < ms.src_end && !anchor);
+    endsearch(&ms);
   }
   lua_pushnil(L);  /* not found */
   return 1;
@@ -560,34 +1177,44 @@ static int gmatch_aux (lua_State *L) {
   MatchState ms;
   size_t ls;
   const char *s = lua_tolstring(L, lua_upvalueindex(1), &ls);
-  const char *p = lua_tostring(L, lua_upvalueindex(2));
+  const Pattern *pat = (const Pattern *)lua_touserdata(L, lua_upvalueindex(2));
+  PatCache *pc = (PatCache *)lua_touserdata(L, lua_upvalueindex(4));
   const char *src;
-  ms.L = L;
-  ms.src_init = s;
-  ms.src_end = s+ls;
+  prepstate(&ms, L, s, ls, pat, pc);
   for (src = s + (size_t)lua_tointeger(L, lua_upvalueindex(3));
        src <= ms.src_end;
        src++) {
     const char *e;
+    if (pat->plen > 0) {  /* skip to its literal prefix */
+      src = lmemfind(src, ms.src_end - src, pat->prefix, pat->plen);
+      if (src == NULL) break;
+    }
     ms.level = 0;
-    if ((e = match(&ms, src, p)) != NULL) {
+    if ((e = match(&ms, src, pat->item)) != NULL) {
       lua_Integer newstart = e-s;
       if (e == src) newstart++;  /* empty match? go at least one position */
       lua_pushinteger(L, newstart);
       lua_replace(L, lua_upvalueindex(3));
+      endsearch(&ms);
       return push_captures(&ms, src, e);
     }
   }
+  endsearch(&ms);
   return 0;  /* not found */
 }
 
 
 static int gmatch (lua_State *L) {
+  size_t lp;
+  const char *p;
   luaL_checkstring(L, 1);
-  luaL_checkstring(L, 2);
+  p = luaL_checklstring(L, 2, &lp);
   lua_settop(L, 2);
+  getpattern(L, p, lp);  /* replaces the pattern */
+  lua_replace(L, 2);
   lua_pushinteger(L, 0);
-  lua_pushcclosure(L, gmatch_aux, 3);
+  lua_pushvalue(L, lua_upvalueindex(1));  /* cache */
+  lua_pushcclosure(L, gmatch_aux, 4);
   return 1;
 }
 
@@ -657,25 +1284,32 @@ static void add_value (MatchState *ms, luaL_Buffer *b, const char *s,
 
 
 static int str_gsub (lua_State *L) {
-  size_t srcl;
+  size_t srcl, lp;
   const char *src = luaL_checklstring(L, 1, &srcl);
-  const char *p = luaL_checkstring(L, 2);
+  const char *p = luaL_checklstring(L, 2, &lp);
   int max_s = luaL_optint(L, 4, srcl+1);
-  int anchor = (*p == '^') ? (p++, 1) : 0;
+  int anchor = (*p == '^');
   int n = 0;
+  const Pattern *pat = getpattern(L, p + anchor, lp - anchor);
+  PatCache *pc = (PatCache *)lua_touserdata(L, lua_upvalueindex(1));
   MatchState ms;
   luaL_Buffer b;
   luaL_buffinit(L, &b);
-  ms.L = L;
-  ms.src_init = src;
-  ms.src_end = src+srcl;
+  prepstate(&ms, L, src, srcl, pat, pc);
   while (n < max_s) {
     const char *e;
+    if (pat->plen > 0 && !anchor) {  /* copy up to its literal prefix */
+      e = lmemfind(src, ms.src_end - src, pat->prefix, pat->plen);
+      if (e == NULL) break;
+      luaL_addlstring(&b, src, e - src);
+      src = e;
+    }
     ms.level = 0;
-    e = match(&ms, src, p);
+    e = match(&ms, src, pat->item);
     if (e) {
       n++;
       add_value(&ms, &b, src, e);
+      clearmemo(&ms, src, e);
     }
     if (e && e>src) /* non empty match? */
       src = e;  /* skip it */
@@ -684,6 +1318,7 @@ static int str_gsub (lua_State *L) {
     else break;
     if (anchor) break;
   }
+  endsearch(&ms);
   luaL_addlstring(&b, src, ms.src_end-src);
   luaL_pushresult(&b);
   lua_pushinteger(L, n);  /* number of substitutions */
@@ -704,29 +1339,69 @@ static int str_gsub (lua_State *L) {
 #define MAX_FORMAT	(sizeof(FLAGS) + sizeof(LUA_INTFRMLEN) + 10)
 
 
-static void addquoted (lua_State *L, luaL_Buffer *b, int arg) {
+/*
+** `addformat' writes to a luaL_Buffer or, for `putf', straight into the
+** free space of a string buffer
+*/
+typedef struct FmtOut {
+  lua_State *L;
+  luaL_Buffer *b;  /* output goes here, or (if NULL) ... */
+  struct StrBuffer *sb;  /* ... here */
+} FmtOut;
+
+
+static char *prepbuffer (lua_State *L, struct StrBuffer *sb, size_t l);
+static void addsizebuffer (struct StrBuffer *sb, size_t l);
+
+
+/* room for `l' more bytes of output */
+static char *outprep (FmtOut *o, size_t l) {
+  if (o->b != NULL) return luaL_prepbuffsize(o->b, l);
+  else return prepbuffer(o->L, o->sb, l);
+}
+
+
+static void outsize (FmtOut *o, size_t l) {
+  if (o->b != NULL) luaL_addsize(o->b, l);
+  else addsizebuffer(o->sb, l);
+}
+
+
+static void outadd (FmtOut *o, const char *s, size_t l) {
+  memcpy(outprep(o, l), s, l);
+  outsize(o, l);
+}
+
+
+static void addquoted (lua_State *L, FmtOut *o, int arg) {
   size_t l;
   const char *s = luaL_checklstring(L, arg, &l);
-  luaL_addchar(b, '"');
+  char *p = outprep(o, 2*l + 2);  /* each char takes at most 2 ... */
+  char *q = p;
+  *q++ = '"';
   while (l--) {
     switch (*s) {
       case '"': case '\\': case '\n': {
-        luaL_addchar(b, '\\');
-        luaL_addchar(b, *s);
+        *q++ = '\\';
+        *q++ = *s;
         break;
       }
-      case '\0': {
-        luaL_addlstring(b, "\\000", 4);
+      case '\0': {  /* ... but this one, which takes 4 */
+        outsize(o, q - p);
+        p = q = outprep(o, 2*l + 5);
+        memcpy(q, "\\000", 4);
+        q += 4;
         break;
       }
       default: {
-        luaL_addchar(b, *s);
+        *q++ = *s;
         break;
       }
     }
     s++;
   }
-  luaL_addchar(b, '"');
+  *q++ = '"';
+  outsize(o, q - p);
 }
 
 static const char *scanformat (lua_State *L, const char *strfrmt, char *form) {
@@ -760,46 +1435,53 @@ static void addintlen (char *form) {
 }
 
 
-static int str_format (lua_State *L) {
-  int arg = 1;
+/* add to `o' the result of formatting arguments `arg', `arg'+1, ... */
+static void addformat (lua_State *L, FmtOut *o, int arg) {
   size_t sfl;
   const char *strfrmt = luaL_checklstring(L, arg, &sfl);
   const char *strfrmt_end = strfrmt+sfl;
-  luaL_Buffer b;
-  luaL_buffinit(L, &b);
   while (strfrmt < strfrmt_end) {
-    if (*strfrmt != L_ESC)
-      luaL_addchar(&b, *strfrmt++);
+    if (*strfrmt != L_ESC) {
+      const char *e = (const char *)memchr(strfrmt, L_ESC,
+                                           strfrmt_end - strfrmt);
+      if (e == NULL) e = strfrmt_end;
+      outadd(o, strfrmt, e - strfrmt);  /* plain chars up to next `%' */
+      strfrmt = e;
+    }
     else if (*++strfrmt == L_ESC)
-      luaL_addchar(&b, *strfrmt++);  /* %% */
+      outadd(o, strfrmt++, 1);  /* %% */
     else { /* format item */
       char form[MAX_FORMAT];  /* to store the format (`%...') */
-      char buff[MAX_ITEM];  /* to store the formatted item */
+      int n;  /* length of the formatted item, written in place */
       arg++;
       strfrmt = scanformat(L, strfrmt, form);
       switch (*strfrmt++) {
         case 'c': {
-          sprintf(buff, form, (int)luaL_checknumber(L, arg));
+          n = sprintf(outprep(o, MAX_ITEM), form,
+                      (int)luaL_checknumber(L, arg));
           break;
         }
         case 'd':  case 'i': {
           addintlen(form);
-          sprintf(buff, form, (LUA_INTFRM_T)luaL_checknumber(L, arg));
+          n = sprintf(outprep(o, MAX_ITEM), form,
+                      (LUA_INTFRM_T)luaL_checknumber(L, arg));
           break;
         }
         case 'o':  case 'u':  case 'x':  case 'X': {
           addintlen(form);
-          sprintf(buff, form, (unsigned LUA_INTFRM_T)luaL_checknumber(L, arg));
+          n = sprintf(outprep(o, MAX_ITEM), form,
+                      (unsigned LUA_INTFRM_T)luaL_checknumber(L, arg));
           break;
         }
         case 'e':  case 'E': case 'f':
         case 'g': case 'G': {
-          sprintf(buff, form, (double)luaL_checknumber(L, arg));
+          n = sprintf(outprep(o, MAX_ITEM), form,
+                      (double)luaL_checknumber(L, arg));
           break;
         }
         case 'q': {
-          addquoted(L, &b, arg);
-          continue;  /* skip the 'addsize' at the end */
+          addquoted(L, o, arg);
+          continue;  /* skip the 'outsize' at the end */
         }
         case 's': {
           size_t l;
@@ -807,39 +1489,198 @@ static int str_format (lua_State *L) {
           if (!strchr(form, '.') && l >= 100) {
             /* no precision and string is too long to be formatted;
                keep original string */
-            lua_pushvalue(L, arg);
-            luaL_addvalue(&b);
-            continue;  /* skip the `addsize' at the end */
+            outadd(o, s, l);
+            continue;  /* skip the `outsize' at the end */
           }
           else {
-            sprintf(buff, form, s);
+            n = sprintf(outprep(o, MAX_ITEM), form, s);
             break;
           }
         }
         default: {  /* also treat cases `pnLlh' */
-          return luaL_error(L, "invalid option to " LUA_QL("format"));
+          luaL_error(L, "invalid option to " LUA_QL("format"));
+          return;
         }
       }
-      luaL_addlstring(&b, buff, strlen(buff));
+      outsize(o, (size_t)n);
     }
   }
+}
+
+
+static int str_format (lua_State *L) {
+  luaL_Buffer b;
+  FmtOut o;
+  luaL_buffinit(L, &b);
+  o.L = L; o.b = &b; o.sb = NULL;
+  addformat(L, &o, 1);
   luaL_pushresult(&b);
   return 1;
 }
 
 
+
+/*
+** {======================================================
+** STRING BUFFERS
+** =======================================================
+*/
+
+/*
+** A buffer grows as needed to hold all the pieces put into it; only
+** `tostring' copies its contents to a string. Its memory comes from
+** `lua_realloc', so the collector counts it, and goes back in `__gc'.
+*/
+
+#define LUA_STRBUFHANDLE	"string.buffer"
+
+typedef struct StrBuffer {
+  char *b;
+  size_t n;  /* number of bytes in use */
+  size_t size;
+} StrBuffer;
+
+
+#define tobuffer(L)	((StrBuffer *)luaL_checkudata(L, 1, LUA_STRBUFHANDLE))
+
+
+/* make room for `l' more bytes */
+static char *prepbuffer (lua_State *L, StrBuffer *sb, size_t l) {
+  if (l > sb->size - sb->n) {
+    size_t newsize = (sb->size < LUAL_BUFFERSIZE) ? LUAL_BUFFERSIZE : sb->size;
+    if (l > ((size_t)~0)/2 - sb->n)
+      luaL_error(L, "string buffer too large");
+    while (newsize - sb->n < l) newsize *= 2;
+    sb->b = (char *)lua_realloc(L, sb->b, sb->size, newsize);
+    sb->size = newsize;
+  }
+  return sb->b + sb->n;
+}
+
+
+/* the `l' bytes after the contents were filled */
+static void addsizebuffer (StrBuffer *sb, size_t l) {
+  sb->n += l;
+}
+
+
+static void buf_add (lua_State *L, StrBuffer *sb, const char *s, size_t l) {
+  memcpy(prepbuffer(L, sb, l), s, l);
+  sb->n += l;
+}
+
+
+static int buf_new (lua_State *L) {
+  lua_Integer size = luaL_optinteger(L, 1, 0);
+  StrBuffer *sb;
+  luaL_argcheck(L, size >= 0, 1, "negative size");
+  sb = (StrBuffer *)lua_newuserdata(L, sizeof(StrBuffer));
+  sb->b = NULL;
+  sb->n = sb->size = 0;
+  luaL_getmetatable(L, LUA_STRBUFHANDLE);
+  lua_setmetatable(L, -2);
+  if (size > 0) prepbuffer(L, sb, (size_t)size);
+  return 1;
+}
+
+
+static int buf_put (lua_State *L) {
+  StrBuffer *sb = tobuffer(L);
+  int n = lua_gettop(L);
+  int i;
+  for (i = 2; i <= n; i++) {
+    size_t l;
+    const char *s = luaL_checklstring(L, i, &l);
+    buf_add(L, sb, s, l);
+  }
+  lua_settop(L, 1);
+  return 1;  /* return the buffer, for chaining */
+}
+
+
+static int buf_putf (lua_State *L) {
+  FmtOut o;
+  o.L = L; o.b = NULL; o.sb = tobuffer(L);
+  addformat(L, &o, 2);
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+static int buf_reserve (lua_State *L) {
+  StrBuffer *sb = tobuffer(L);
+  lua_Integer size = luaL_checkinteger(L, 2);
+  luaL_argcheck(L, size >= 0, 2, "negative size");
+  prepbuffer(L, sb, (size_t)size);
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+static int buf_reset (lua_State *L) {
+  tobuffer(L)->n = 0;  /* keep its memory for the next pieces */
+  lua_settop(L, 1);
+  return 1;
+}
+
+
+static int buf_tostring (lua_State *L) {
+  StrBuffer *sb = tobuffer(L);
+  lua_pushlstring(L, (sb->n > 0) ? sb->b : "", sb->n);
+  return 1;
+}
+
+
+static int buf_len (lua_State *L) {
+  lua_pushinteger(L, (lua_Integer)tobuffer(L)->n);
+  return 1;
+}
+
+
+static int buf_gc (lua_State *L) {
+  StrBuffer *sb = tobuffer(L);
+  lua_realloc(L, sb->b, sb->size, 0);
+  sb->b = NULL;
+  sb->n = sb->size = 0;
+  return 0;
+}
+
+
+static const luaL_Reg buflib[] = {
+  {"put", buf_put},
+  {"putf", buf_putf},
+  {"reserve", buf_reserve},
+  {"reset", buf_reset},
+  {"tostring", buf_tostring},
+  {"__gc", buf_gc},
+  {"__len", buf_len},
+  {"__tostring", buf_tostring},
+  {NULL, NULL}
+};
+
+
+static void createbufmeta (lua_State *L) {
+  luaL_newmetatable(L, LUA_STRBUFHANDLE);  /* metatable for buffers */
+  lua_pushvalue(L, -1);  /* push metatable */
+  lua_setfield(L, -2, "__index");  /* metatable.__index = metatable */
+  luaL_register(L, NULL, buflib);  /* buffer methods */
+  lua_pop(L, 1);
+}
+
+/* }====================================================== */
+
+
+
+
 static const luaL_Reg strlib[] = {
+  {"buffer", buf_new},
   {"byte", str_byte},
   {"char", str_char},
   {"dump", str_dump},
-  {"find", str_find},
   {"format", str_format},
   {"gfind", gfind_nodef},
-  {"gmatch", gmatch},
-  {"gsub", str_gsub},
   {"len", str_len},
   {"lower", str_lower},
-  {"match", str_match},
   {"rep", str_rep},
   {"reverse", str_reverse},
   {"sub", str_sub},
@@ -848,6 +1689,37 @@ static const luaL_Reg strlib[] = {
 };
 
 
+/* functions sharing the cache of compiled patterns */
+static const luaL_Reg patlib[] = {
+  {"find", str_find},
+  {"gmatch", gmatch},
+  {"gsub", str_gsub},
+  {"match", str_match},
+  {NULL, NULL}
+};
+
+
+static void createpatcache (lua_State *L) {
+  const luaL_Reg *l;
+  PatCache *pc = (PatCache *)lua_newuserdata(L, sizeof(PatCache));
+  pc->n = 0;
+  pc->memo = NULL;
+  pc->memosize = 0;
+  pc->gen = 0;
+  pc->locale[0] = '\0';
+  lua_createtable(L, 0, 1);
+  lua_pushcfunction(L, cache_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_setmetatable(L, -2);
+  for (l = patlib; l->name; l++) {
+    lua_pushvalue(L, -1);
+    lua_pushcclosure(L, l->func, 1);
+    lua_setfield(L, -3, l->name);
+  }
+  lua_pop(L, 1);
+}
+
+
 static void createmetatable (lua_State *L) {
   lua_createtable(L, 0, 1);  /* create metatable for strings */
   lua_pushliteral(L, "");  /* dummy string */
@@ -865,11 +1737,13 @@ static void createmetatable (lua_State *L) {
 */
 LUALIB_API int luaopen_string (lua_State *L) {
   luaL_register(L, LUA_STRLIBNAME, strlib);
+  createpatcache(L);
 #if defined(LUA_COMPAT_GFIND)
   lua_getfield(L, -1, "gmatch");
   lua_setfield(L, -2, "gfind");
 #endif
   createmetatable(L);
+  createbufmeta(L);
   return 1;
 }
 
@@ -16,6 +16,8 @@
 ** in its main position (i.e. the `original' position that its hash gives
 ** to it), then the colliding element is in its own main position.
 ** Hence even when the load factor reaches 100%, performance remains good.
+** With LUA_SWISSTABLE the hash part uses open addressing instead (see
+** below).
 */
 
 #include <math.h>
@@ -32,8 +34,13 @@
 #include "lmem.h"
 #include "lobject.h"
 #include "lstate.h"
+#include "lstring.h"
 #include "ltable.h"
 
+#if defined(LUA_SWISSTABLE) && defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 
 /*
  * max size of array part is 2^MAXBITS
@@ -68,7 +75,7 @@
 /*
  * 处理字符串用的，以字符串的hash值作为参数，调用上面定义的宏函数
  */
-#define hashstr(t,str)  hashpow2(t, (str)->tsv.hash)
+#define hashstr(t,str)  hashpow2(t, luaS_hash(str))
 /*
  * 同上，给boolean用的，boolean就俩值，1或0，由此可见,对于一个表
  */
@@ -115,16 +122,19 @@
  * 空Node的定义
  */
 static const Node dummynode_ = {
-  {{NULL}, LUA_TNIL},  /* value */
-  {{{NULL}, LUA_TNIL, NULL}}  /* key */
+  {NILCONSTANT},  /* value */
+#if !defined(LUA_SWISSTABLE)
+  {{NILCONSTANT, NULL}}  /* key */
+#else
+  {{NILCONSTANT}}  /* key */
+#endif
 };
 
 
 /* O(1)
  * hash for lua_Numbers
- * 以一个lua_Number,为key,到hash表中取一个Node
  */
-static Node *hashnum (const Table *t, lua_Number n) {
+static unsigned int numhash (lua_Number n) {
   unsigned int a[numints];
   int i;
   n += 1;  /* normalize number (avoid -0) */
@@ -133,8 +143,17 @@ static Node *hashnum (const Table *t, lua_Number n) {
   /*下面两行涉及到 lua_Number是如何存储的*/
   memcpy(a, &n, sizeof(a));
   for (i = 1; i < numints; i++) a[0] += a[i];
+  return a[0];
+}
+
 
-  return hashmod(t, a[0]);
+#if !defined(LUA_SWISSTABLE)
+
+/* O(1)
+ * 以一个lua_Number,为key,到hash表中取一个Node
+ */
+static Node *hashnum (const Table *t, lua_Number n) {
+  return hashmod(t, numhash(n));
 }
 
 /* O(1)
@@ -168,6 +187,185 @@ static Node *mainposition (const Table *t, const TValue *key) {
   }
 }
 
+#else
+
+/*
+** {=============================================================
+** Open-addressing hash part (LUA_SWISSTABLE)
+** Each node has a control byte, which is either CTRLEMPTY (a free
+** node) or the low 7 bits of the hash of its key. A search loads a
+** group of CTRLGROUP control bytes starting at the home position of
+** the key and only compares the keys whose byte matches; a group with
+** a free node ends it. Groups are visited with growing steps
+** (triangular numbers), which reach every node of a table whose size
+** is a power of 2. Keys are never removed (keys of nil values stay in
+** their nodes until the next rehash), so there are no tombstones.
+** Tables with up to CTRLGROUP nodes are seen whole by a single group
+** starting at node 0 (the bytes after their last node stay empty) and
+** may be full; larger ones keep their load factor at most 7/8 (through
+** `growleft'), so that every search meets a free node.
+** ==============================================================
+*/
+
+#define CTRLEMPTY	0x80
+#define CTRLTAG(h)	cast_int((h) & 0x7F)
+#define CTRLHOME(t,h)	(sizenode(t) <= CTRLGROUP ? 0 : \
+			 ((h) >> 7) & cast(lu_int32, sizenode(t) - 1))
+
+/* number of keys that fit in `size' nodes */
+#define maxgrowth(size)	((size) <= CTRLGROUP ? (size) : (size) - (size)/8)
+
+/* control bytes of `dummynode' */
+static const lu_byte dummyctrl_[CTRLGROUP] = {
+  CTRLEMPTY, CTRLEMPTY, CTRLEMPTY, CTRLEMPTY,
+  CTRLEMPTY, CTRLEMPTY, CTRLEMPTY, CTRLEMPTY,
+  CTRLEMPTY, CTRLEMPTY, CTRLEMPTY, CTRLEMPTY,
+  CTRLEMPTY, CTRLEMPTY, CTRLEMPTY, CTRLEMPTY
+};
+
+#define dummyctrl	cast(lu_byte *, dummyctrl_)
+
+
+#if defined(__SSE2__)
+
+#define loadgroup(g)	_mm_loadu_si128(cast(const __m128i *, (g)))
+
+/* bit `i' of the result is set if control byte `i' of group `g' is `c' */
+#define matchtag(g,c)	cast(unsigned int, _mm_movemask_epi8( \
+	_mm_cmpeq_epi8(loadgroup(g), _mm_set1_epi8(cast(char, c)))))
+
+/* only CTRLEMPTY has its high bit set */
+#define matchempty(g)	cast(unsigned int, _mm_movemask_epi8(loadgroup(g)))
+
+#else
+
+static unsigned int matchtag (const lu_byte *g, int c) {
+  unsigned int m = 0;
+  int i;
+  for (i = 0; i < CTRLGROUP; i++)
+    if (g[i] == c) m |= 1u << i;
+  return m;
+}
+
+#define matchempty(g)	matchtag(g, CTRLEMPTY)
+
+#endif
+
+
+#if defined(__GNUC__)
+#define lowbit(m)	__builtin_ctz(m)
+#else
+static int lowbit (unsigned int m) {
+  int i = 0;
+  while (!(m & 1)) { m >>= 1; i++; }
+  return i;
+}
+#endif
+
+
+/*
+** runs `body' with `n' set to each node of `t' whose control byte
+** matches hash `h'; `body' leaves the search with a `return'
+*/
+#define probe(t,h,n,body) { \
+  lu_int32 p_mask = cast(lu_int32, sizenode(t) - 1); \
+  lu_int32 p_pos = CTRLHOME(t, h); \
+  lu_int32 p_step = 0; \
+  for (;;) { \
+    const lu_byte *p_g = (t)->ctrl + p_pos; \
+    unsigned int p_m = matchtag(p_g, CTRLTAG(h)); \
+    for (; p_m != 0; p_m &= p_m - 1) { \
+      n = gnode(t, (p_pos + lowbit(p_m)) & p_mask); \
+      body \
+    } \
+    if (matchempty(p_g) || p_mask < CTRLGROUP) break; \
+    p_step += CTRLGROUP; \
+    p_pos = (p_pos + p_step) & p_mask; \
+  } }
+
+
+/*
+** final mix of a hash value, so that both its low bits (the tag) and
+** its high bits (the home position) depend on all of its bits
+*/
+static lu_int32 mixhash (lu_int32 h) {
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35u;
+  h ^= h >> 16;
+  return h;
+}
+
+
+static lu_int32 keyhash (const TValue *key) {
+  switch (ttype(key)) {
+    case LUA_TNUMBER:
+      return mixhash(numhash(nvalue(key)));
+    case LUA_TSTRING:
+      return mixhash(luaS_hash(rawtsvalue(key)));
+    case LUA_TBOOLEAN:
+      return mixhash(bvalue(key));
+    case LUA_TLIGHTUSERDATA:
+      return mixhash(IntPoint(pvalue(key)));
+    default:
+      return mixhash(IntPoint(gcvalue(key)));
+  }
+}
+
+
+/*
+** set control byte of node `i'; in large tables, the first bytes are
+** mirrored after the last node, so that any group can be loaded whole
+*/
+static void setctrl (Table *t, int i, int c) {
+  int size = sizenode(t);
+  t->ctrl[i] = cast_byte(c);
+  if (i < CTRLGROUP && size > CTRLGROUP)
+    t->ctrl[i + size] = cast_byte(c);
+}
+
+
+static int findfree (const Table *t, lu_int32 h) {
+  lu_int32 mask = cast(lu_int32, sizenode(t) - 1);
+  lu_int32 pos = CTRLHOME(t, h);
+  lu_int32 step = 0;
+  for (;;) {
+    unsigned int m = matchempty(t->ctrl + pos);
+    if (m != 0)
+      return cast_int((pos + lowbit(m)) & mask);
+    step += CTRLGROUP;
+    pos = (pos + step) & mask;
+  }
+}
+
+/* }============================================================= */
+
+#endif
+
+
+#if defined(LUA_SHAPES)
+
+/* O(n)
+ * index of `key' in shape `s', or -1 if it is not there
+ */
+static int shapeindex (const Shape *s, const TString *key) {
+  int i;
+  for (i = 0; i < s->nkeys; i++) {
+    if (s->keys[i] == key)
+      return i;
+  }
+  return -1;
+}
+
+
+static const TValue *shapeget (const Table *t, const TString *key) {
+  int i = shapeindex(t->shape, key);
+  return (i < 0) ? luaO_nilobject : &t->slots[i];
+}
+
+#endif
+
 
 /* O(1)
  * returns the index for `key' if `key' is an appropriate key to live in
@@ -179,9 +377,10 @@ static Node *mainposition (const Table *t, const TValue *key) {
  * 其他类型，或者类型强转失败了，就返回-1
  */
 static int arrayindex (const TValue *key) {
-
+  if (ttisint(key))  /* integer variant needs no conversion */
+    return cast_int(ivalue(key));
     /*检查是否是一个number类型的TValue*/
-  if (ttisnumber(key)) {
+  else if (ttisnumber(key)) {
     lua_Number n = nvalue(key);
     int k;
     /*lua_number2int 这个宏值得推敲下,在luaconf.h中定义*/
@@ -221,6 +420,29 @@ static int findindex (lua_State *L, Table *t, StkId key) {
    */
   if (0 < i && i <= t->sizearray)  /* is `key' inside array part? */
     return i-1;  /* yes; that's the index (corrected to C) */
+#if defined(LUA_SHAPES)
+  else if (t->shape && ttisstring(key) && !islong(rawtsvalue(key))) {
+    /* slots are numbered after hash elements */
+    i = shapeindex(t->shape, rawtsvalue(key));
+    if (i < 0)
+      luaG_runerror(L, "invalid key to " LUA_QL("next"));  /* key not found */
+    return i + t->sizearray + sizenode(t);
+  }
+#endif
+#if defined(LUA_SWISSTABLE)
+  else {
+    Node *n;
+    probe(t, keyhash(key), n,
+      /* key may be dead already, but it is ok to use it in `next' */
+      if (luaO_rawequalObj(key2tval(n), key) ||
+            (ttype(gkey(n)) == LUA_TDEADKEY && iscollectable(key) &&
+             gcvalue(gkey(n)) == gcvalue(key)))
+        return cast_int(n - gnode(t, 0)) + t->sizearray;
+    )
+    luaG_runerror(L, "invalid key to " LUA_QL("next"));  /* key not found */
+    return 0;  /* to avoid warnings */
+  }
+#else
   else {
     /* 不在数组里,那就到hash表中找了
      * 调用mainposition获取到那个链表
@@ -257,6 +479,7 @@ static int findindex (lua_State *L, Table *t, StkId key) {
     luaG_runerror(L, "invalid key to " LUA_QL("next"));  /* key not found */
     return 0;  /* to avoid warnings */
   }
+#endif
 }
 
 
@@ -276,7 +499,7 @@ int luaH_next (lua_State *L, Table *t, StkId key) {
     /*不是nil*/
     if (!ttisnil(&t->array[i])) {  /* a non-nil value? */
       /*把key值设置成next元素的下表i+1(lua数组以0开始)*/
-      setnvalue(key, cast_num(i+1));
+      setivalue(key, i+1);
       /*把next实际元素放到栈中,key的上面*/
       setobj2s(L, key+1, &t->array[i]);
       return 1;
@@ -295,6 +518,17 @@ int luaH_next (lua_State *L, Table *t, StkId key) {
       return 1;
     }
   }
+#if defined(LUA_SHAPES)
+  if (t->shape) {
+    for (i -= sizenode(t); i < t->shape->nkeys; i++) {  /* then slots */
+      if (!ttisnil(&t->slots[i])) {
+        setsvalue2s(L, key, t->shape->keys[i]);
+        setobj2s(L, key+1, &t->slots[i]);
+        return 1;
+      }
+    }
+  }
+#endif
   return 0;  /* no more elements */
 }
 
@@ -440,6 +674,10 @@ static void setarrayvector (lua_State *L, Table *t, int size) {
 }
 
 
+#if !defined(LUA_SWISSTABLE)
+
+#define freenodes(L,n,size)	luaM_freearray(L, n, size, Node)
+
 /* O(n)
  * 重设hash表, 完全重新申请一块size大小的内存,所有内存初设为nil
  */
@@ -478,6 +716,46 @@ static void setnodevector (lua_State *L, Table *t, int size) {
   t->lastfree = gnode(t, size);  /* all positions are free */
 }
 
+#else
+
+/* nodes and control bytes live in a single block */
+#define freenodes(L,n,size) \
+	luaM_freemem(L, n, (size) * sizeof(Node) + (size) + CTRLGROUP)
+
+/* O(n)
+ * `size' is the number of keys the new hash part must hold
+ */
+static void setnodevector (lua_State *L, Table *t, int size) {
+  int lsize;
+  if (size == 0) {  /* no elements to hash part? */
+    t->node = cast(Node *, dummynode);  /* use common `dummynode' */
+    t->ctrl = dummyctrl;
+    lsize = 0;
+  }
+  else {
+    int i;
+    lsize = ceillog2(size);
+    if (maxgrowth(twoto(lsize)) < size)
+      lsize++;  /* keep the load factor at most 7/8 */
+    if (lsize > MAXBITS)
+      luaG_runerror(L, "table overflow");
+    size = twoto(lsize);
+    t->node = cast(Node *, luaM_malloc(L, size * sizeof(Node) +
+                                          size + CTRLGROUP));
+    t->ctrl = cast(lu_byte *, t->node + size);
+    for (i=0; i<size; i++) {
+      Node *n = gnode(t, i);
+      setnilvalue(gkey(n));
+      setnilvalue(gval(n));
+    }
+    memset(t->ctrl, CTRLEMPTY, size + CTRLGROUP);
+  }
+  t->lsizenode = cast_byte(lsize);
+  t->growleft = (size == 0) ? 0 : maxgrowth(size);
+}
+
+#endif
+
 /* O(nhsize)
  * 重置Table大小
  */
@@ -520,14 +798,18 @@ static void resize (lua_State *L, Table *t, int nasize, int nhsize) {
   }
   /*free掉原hash表*/
   if (nold != dummynode)
-    luaM_freearray(L, nold, twoto(oldhsize), Node);  /* free old array */
+    freenodes(L, nold, twoto(oldhsize));  /* free old array */
 }
 
 /* O(1)
  * 重设数组大小,
  */ 
 void luaH_resizearray (lua_State *L, Table *t, int nasize) {
+#if !defined(LUA_SWISSTABLE)
   int nsize = (t->node == dummynode) ? 0 : sizenode(t);
+#else
+  int nsize = (t->node == dummynode) ? 0 : maxgrowth(sizenode(t));
+#endif
   resize(L, t, nasize, nsize);
 }
 
@@ -577,9 +859,27 @@ Table *luaH_new (lua_State *L, int narray, int nhash) {
   /* temporary values (kept only if some malloc fails) */
   t->array = NULL;
   t->sizearray = 0;
+  t->lenhint = 0;
   t->lsizenode = 0;
   t->node = cast(Node *, dummynode);
+#if defined(LUA_SWISSTABLE)
+  t->ctrl = dummyctrl;
+  t->growleft = 0;
+#endif
+#if defined(LUA_SHAPES)
+  t->shape = NULL;
+  t->slots = NULL;
+  t->sizeslots = 0;
+#endif
   setarrayvector(L, t, narray);
+#if defined(LUA_SHAPES)
+  if (nhash <= LUAI_MAXSHAPEKEYS) {  /* small enough for a shape? */
+    t->slots = luaM_newvector(L, nhash, TValue);
+    t->sizeslots = nhash;
+    t->shape = &G(L)->rootshape;
+    nhash = 0;  /* keys go to the slots */
+  }
+#endif
   setnodevector(L, t, nhash);
   return t;
 }
@@ -587,11 +887,16 @@ Table *luaH_new (lua_State *L, int narray, int nhash) {
 /* 释放表所占的内存 */
 void luaH_free (lua_State *L, Table *t) {
   if (t->node != dummynode)
-    luaM_freearray(L, t->node, sizenode(t), Node);
+    freenodes(L, t->node, sizenode(t));
   luaM_freearray(L, t->array, t->sizearray, TValue);
+#if defined(LUA_SHAPES)
+  luaM_freearray(L, t->slots, t->sizeslots, TValue);
+#endif
   luaM_free(L, t);
 }
 
+#if !defined(LUA_SWISSTABLE)
+
 /* O(1)
  * 获得hash表中最后一个空位
  */
@@ -657,12 +962,152 @@ static TValue *newkey (lua_State *L, Table *t, const TValue *key) {
     }
   }
   /*设置新key*/
-  gkey(mp)->value = key->value; gkey(mp)->tt = key->tt;
+  setobj2t(L, key2tval(mp), key);
   luaC_barriert(L, t, key);
   lua_assert(ttisnil(gval(mp)));
   return gval(mp);
 }
 
+#else
+
+/* O(1)
+** inserts a new key into the first free node of its probe sequence.
+** A node with the same tag but a nil value (a removed key) is reused
+** instead, as the chained version does with its main position; this
+** also keeps a dead key from shadowing a new key at the same address
+** in `findindex'
+*/
+static TValue *newkey (lua_State *L, Table *t, const TValue *key) {
+  lu_int32 h = keyhash(key);
+  Node *n;
+  Node *old = NULL;
+  probe(t, h, n,
+    if (old == NULL && ttisnil(gval(n))) old = n;
+  )
+  if (old != NULL)
+    n = old;
+  else if (t->growleft == 0) {  /* table is full? */
+    rehash(L, t, key);  /* grow table */
+    return luaH_set(L, t, key);  /* re-insert key into grown table */
+  }
+  else {
+    int i = findfree(t, h);
+    setctrl(t, i, CTRLTAG(h));
+    t->growleft--;
+    n = gnode(t, i);
+  }
+  setobj2t(L, key2tval(n), key);
+  luaC_barriert(L, t, key);
+  lua_assert(ttisnil(gval(n)));
+  return gval(n);
+}
+
+#endif
+
+
+#if defined(LUA_SHAPES)
+
+/*
+** {=============================================================
+** Shapes (LUA_SHAPES)
+** A table with a shape keeps its string keys in the shape and their
+** values in `slots'; other keys go to the array and hash parts as
+** usual. Adding a string key moves the table to the child shape with
+** that key, creating it if needed, so tables that got the same keys in
+** the same order share a shape. A table whose shape cannot grow (too
+** many keys or shapes) moves its string keys to the hash part and
+** never gets a shape again. Shapes live as long as the state; the GC
+** keeps their keys alive (see `markshapes').
+** ==============================================================
+*/
+
+/* O(n)
+ * moves the keys of a table out of its shape into its hash part
+ */
+static void unshape (lua_State *L, Table *t) {
+  const Shape *s = t->shape;
+  TValue *slots = t->slots;
+  int sizeslots = t->sizeslots;
+  int nuse = 1;  /* count the key being added */
+  int i;
+  for (i = 0; i < s->nkeys; i++) {
+    if (!ttisnil(&slots[i])) nuse++;
+  }
+  for (i = 0; i < sizenode(t); i++) {
+    if (!ttisnil(gval(gnode(t, i)))) nuse++;
+  }
+  resize(L, t, t->sizearray, nuse);
+  t->shape = NULL;
+  t->slots = NULL;
+  t->sizeslots = 0;
+  for (i = 0; i < s->nkeys; i++) {
+    if (!ttisnil(&slots[i])) {
+      TValue k;
+      setsvalue(L, &k, s->keys[i]);
+      setobjt2t(L, newkey(L, t, &k), &slots[i]);
+    }
+  }
+  luaM_freearray(L, slots, sizeslots, TValue);
+}
+
+
+/* O(1) amortized
+ * adds string `key' to a table with a shape
+ */
+static TValue *shapenewkey (lua_State *L, Table *t, const TValue *key) {
+  global_State *g = G(L);
+  Shape *s = t->shape;
+  TString *ts = rawtsvalue(key);
+  Shape *c;
+  for (c = s->child; c != NULL; c = c->sibling) {  /* known transition? */
+    if (c->keys[s->nkeys] == ts) break;
+  }
+  if (c == NULL) {
+    if (s->nkeys == LUAI_MAXSHAPEKEYS || g->nshapes == LUAI_MAXSHAPES) {
+      unshape(L, t);
+      return newkey(L, t, key);
+    }
+    c = cast(Shape *, luaM_malloc(L, sizeshape(s->nkeys + 1)));
+    memcpy(c->keys, s->keys, s->nkeys * sizeof(TString *));
+    c->keys[s->nkeys] = ts;
+    c->nkeys = s->nkeys + 1;
+    c->child = NULL;
+    c->sibling = s->child;
+    s->child = c;
+    g->nshapes++;
+  }
+  if (c->nkeys > t->sizeslots) {  /* grow slots */
+    int size = (t->sizeslots < 2) ? 4 : 2 * t->sizeslots;
+    if (size > LUAI_MAXSHAPEKEYS) size = LUAI_MAXSHAPEKEYS;
+    luaM_reallocvector(L, t->slots, t->sizeslots, size, TValue);
+    t->sizeslots = size;
+  }
+  t->shape = c;
+  setnilvalue(&t->slots[c->nkeys - 1]);
+  return &t->slots[c->nkeys - 1];
+}
+
+
+static void freeshapes (lua_State *L, Shape *s) {
+  while (s != NULL) {
+    Shape *next = s->sibling;
+    freeshapes(L, s->child);
+    luaM_freemem(L, s, sizeshape(s->nkeys));
+    s = next;
+  }
+}
+
+
+void luaH_freeshapes (lua_State *L) {
+  freeshapes(L, G(L)->rootshape.child);
+  G(L)->rootshape.child = NULL;
+  G(L)->nshapes = 0;
+}
+
+/* }============================================================= */
+
+#endif
+
 
 /* O(1)
  * search function for integers
@@ -677,12 +1122,22 @@ const TValue *luaH_getnum (Table *t, int key) {
     return &t->array[key-1];
   else {
     lua_Number nk = cast_num(key);
+#if !defined(LUA_SWISSTABLE)
     Node *n = hashnum(t, nk);
     do {  /* check whether `key' is somewhere in the chain */
-      if (ttisnumber(gkey(n)) && luai_numeq(nvalue(gkey(n)), nk))
+      if (ttisint(gkey(n)) ? ivalue(gkey(n)) == key :
+          ttisfloat(gkey(n)) && luai_numeq(fltvalue(gkey(n)), nk))
         return gval(n);  /* that's it */
       else n = gnext(n);
     } while (n);
+#else
+    Node *n;
+    probe(t, mixhash(numhash(nk)), n,
+      if (ttisint(gkey(n)) ? ivalue(gkey(n)) == key :
+          ttisfloat(gkey(n)) && luai_numeq(fltvalue(gkey(n)), nk))
+        return gval(n);
+    )
+#endif
     return luaO_nilobject;
   }
 }
@@ -692,13 +1147,96 @@ const TValue *luaH_getnum (Table *t, int key) {
  * search function for strings
  * key为string的查找,到hash表里找
  */
+/* long strings are compared by contents; they are never in shapes */
+static const TValue *getlngstr (Table *t, TString *key) {
+  Node *n;
+#if !defined(LUA_SWISSTABLE)
+  n = hashstr(t, key);
+  do {  /* check whether `key' is somewhere in the chain */
+    if (ttisstring(gkey(n)) && luaS_eqstr(rawtsvalue(gkey(n)), key))
+      return gval(n);  /* that's it */
+    else n = gnext(n);
+  } while (n);
+#else
+  probe(t, mixhash(luaS_hash(key)), n,
+    if (ttisstring(gkey(n)) && luaS_eqstr(rawtsvalue(gkey(n)), key))
+      return gval(n);
+  )
+#endif
+  return luaO_nilobject;
+}
+
+
 const TValue *luaH_getstr (Table *t, TString *key) {
-  Node *n = hashstr(t, key);
+  Node *n;
+  if (islong(key))
+    return getlngstr(t, key);
+#if defined(LUA_SHAPES)
+  if (t->shape)
+    return shapeget(t, key);
+#endif
+#if !defined(LUA_SWISSTABLE)
+  n = hashstr(t, key);
   do {  /* check whether `key' is somewhere in the chain */
     if (ttisstring(gkey(n)) && rawtsvalue(gkey(n)) == key)
       return gval(n);  /* that's it */
     else n = gnext(n);
   } while (n);
+#else
+  probe(t, mixhash(key->tsv.hash), n,
+    if (ttisstring(gkey(n)) && rawtsvalue(gkey(n)) == key)
+      return gval(n);
+  )
+#endif
+  return luaO_nilobject;
+}
+
+
+/* O(1)
+ * search function for strings driven by an inline cache: `*hint' is the
+ * node index where `key' was last found (in this or in some other
+ * table). The hint is checked against the key before use, so it can
+ * never be wrong, only stale; it is updated when the key is found
+ * elsewhere.
+ */
+const TValue *luaH_getstrhint (Table *t, TString *key, int *hint) {
+  Node *n;
+  if (islong(key))
+    return getlngstr(t, key);
+#if defined(LUA_SHAPES)
+  if (t->shape) {  /* the hint is a slot index */
+    const Shape *s = t->shape;
+    int i = *hint;
+    if (i < s->nkeys && s->keys[i] == key)
+      return &t->slots[i];  /* cache hit */
+    i = shapeindex(s, key);
+    if (i < 0) return luaO_nilobject;
+    *hint = i;
+    return &t->slots[i];
+  }
+#endif
+  if (*hint < sizenode(t)) {
+    n = gnode(t, *hint);
+    if (ttisstring(gkey(n)) && rawtsvalue(gkey(n)) == key)
+      return gval(n);  /* cache hit */
+  }
+#if !defined(LUA_SWISSTABLE)
+  n = hashstr(t, key);
+  do {  /* check whether `key' is somewhere in the chain */
+    if (ttisstring(gkey(n)) && rawtsvalue(gkey(n)) == key) {
+      *hint = cast_int(n - gnode(t, 0));
+      return gval(n);
+    }
+    else n = gnext(n);
+  } while (n);
+#else
+  probe(t, mixhash(key->tsv.hash), n,
+    if (ttisstring(gkey(n)) && rawtsvalue(gkey(n)) == key) {
+      *hint = cast_int(n - gnode(t, 0));
+      return gval(n);
+    }
+  )
+#endif
   return luaO_nilobject;
 }
 
@@ -714,19 +1252,30 @@ const TValue *luaH_get (Table *t, const TValue *key) {
     case LUA_TSTRING: return luaH_getstr(t, rawtsvalue(key));
     case LUA_TNUMBER: {
       int k;
-      lua_Number n = nvalue(key);
+      lua_Number n;
+      if (ttisint(key))
+        return luaH_getnum(t, cast_int(ivalue(key)));
+      n = fltvalue(key);
       lua_number2int(k, n);
-      if (luai_numeq(cast_num(k), nvalue(key))) /* index is int? */
+      if (luai_numeq(cast_num(k), n)) /* index is int? */
         return luaH_getnum(t, k);  /* use specialized version */
       /* else go through */
     }
     default: {
+#if !defined(LUA_SWISSTABLE)
       Node *n = mainposition(t, key);
       do {  /* check whether `key' is somewhere in the chain */
         if (luaO_rawequalObj(key2tval(n), key))
           return gval(n);  /* that's it */
         else n = gnext(n);
       } while (n);
+#else
+      Node *n;
+      probe(t, keyhash(key), n,
+        if (luaO_rawequalObj(key2tval(n), key))
+          return gval(n);
+      )
+#endif
       return luaO_nilobject;
     }
   }
@@ -747,6 +1296,10 @@ TValue *luaH_set (lua_State *L, Table *t, const TValue *key) {
     if (ttisnil(key)) luaG_runerror(L, "table index is nil");
     else if (ttisnumber(key) && luai_numisnan(nvalue(key)))
       luaG_runerror(L, "table index is NaN");
+#if defined(LUA_SHAPES)
+    if (t->shape && ttisstring(key) && !islong(rawtsvalue(key)))
+      return shapenewkey(L, t, key);
+#endif
     return newkey(L, t, key);
   }
 }
@@ -762,7 +1315,7 @@ TValue *luaH_setnum (lua_State *L, Table *t, int key) {
         /*好像是从nasize开始,所有元素都往后移动一位*/
   else {
     TValue k;
-    setnvalue(&k, cast_num(key));
+    setivalue(&k, key);
     return newkey(L, t, &k);
   }
 }
@@ -780,6 +1333,10 @@ TValue *luaH_setstr (lua_State *L, Table *t, TString *key) {
   else {
     TValue k;
     setsvalue(L, &k, key);
+#if defined(LUA_SHAPES)
+    if (t->shape && !islong(key))
+      return shapenewkey(L, t, &k);
+#endif
     return newkey(L, t, &k);
   }
 }
@@ -813,11 +1370,29 @@ static int unbound_search (Table *t, unsigned int j) {
 }
 
 
+/* O(1)
+ * checks the border found last time and its neighbours; appending to
+ * a sequence, or removing its last element, moves the border by one.
+ * Returns the border or -1 if none of them is.
+ */
+static int hintborder (Table *t) {
+  int j = t->lenhint;
+  if (j > 0 && ttisnil(luaH_getnum(t, j))) {  /* border moved down? */
+    if (j == 1 || !ttisnil(luaH_getnum(t, j - 1)))
+      return j - 1;
+  }
+  else if (j < MAX_INT - 1 && ttisnil(luaH_getnum(t, j + 1)))
+    return j;  /* still a border */
+  else if (j < MAX_INT - 1 && ttisnil(luaH_getnum(t, j + 2)))
+    return j + 1;  /* border moved up */
+  return -1;
+}
+
+
 /* O(log(n))
-** Try to find a boundary in table `t'. A `boundary' is an integer index
-** such that t[i] is non-nil and t[i+1] is nil (and 0 if t[1] is nil).
-*/
-int luaH_getn (Table *t) {
+ * search for a border without a hint
+ */
+static int findborder (Table *t) {
   unsigned int j = t->sizearray;
 
   /* 对array从后往前找,找到第一个nil值,就是表的长度了 */
@@ -839,11 +1414,28 @@ int luaH_getn (Table *t) {
 }
 
 
+/* O(1) amortized
+** Try to find a boundary in table `t'. A `boundary' is an integer index
+** such that t[i] is non-nil and t[i+1] is nil (and 0 if t[1] is nil).
+*/
+int luaH_getn (Table *t) {
+  int b = hintborder(t);
+  if (b < 0)
+    b = findborder(t);
+  t->lenhint = b;
+  return b;
+}
+
+
 
 #if defined(LUA_DEBUG)
 
 Node *luaH_mainposition (const Table *t, const TValue *key) {
+#if !defined(LUA_SWISSTABLE)
   return mainposition(t, key);
+#else
+  return gnode(t, CTRLHOME(t, keyhash(key)));
+#endif
 }
 
 int luaH_isdummy (Node *n) { return n == dummynode; }
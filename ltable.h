@@ -13,14 +13,30 @@
 #define gnode(t,i)	(&(t)->node[i])
 #define gkey(n)		(&(n)->i_key.nk)
 #define gval(n)		(&(n)->i_val)
+
+#if !defined(LUA_SWISSTABLE)
 #define gnext(n)	((n)->i_key.nk.next)
+#define hashbytes(t)	(sizeof(Node) * sizenode(t))
+#else
+#define CTRLGROUP	16  /* number of control bytes probed at once */
+/* control bytes after the last node mirror the first ones */
+#define sizectrl(t)	(sizenode(t) + CTRLGROUP)
+#define hashbytes(t)	(sizeof(Node) * sizenode(t) + sizectrl(t))
+#endif
 
 #define key2tval(n)	(&(n)->i_key.tvk)
 
+#if defined(LUA_SHAPES)
+#define slotbytes(t)	(sizeof(TValue) * (t)->sizeslots)
+#else
+#define slotbytes(t)	0
+#endif
+
 
 LUAI_FUNC const TValue *luaH_getnum (Table *t, int key);
 LUAI_FUNC TValue *luaH_setnum (lua_State *L, Table *t, int key);
 LUAI_FUNC const TValue *luaH_getstr (Table *t, TString *key);
+LUAI_FUNC const TValue *luaH_getstrhint (Table *t, TString *key, int *hint);
 LUAI_FUNC TValue *luaH_setstr (lua_State *L, Table *t, TString *key);
 LUAI_FUNC const TValue *luaH_get (Table *t, const TValue *key);
 LUAI_FUNC TValue *luaH_set (lua_State *L, Table *t, const TValue *key);
@@ -29,6 +45,9 @@ LUAI_FUNC void luaH_resizearray (lua_State *L, Table *t, int nasize);
 LUAI_FUNC void luaH_free (lua_State *L, Table *t);
 LUAI_FUNC int luaH_next (lua_State *L, Table *t, StkId key);
 LUAI_FUNC int luaH_getn (Table *t);
+#if defined(LUA_SHAPES)
+LUAI_FUNC void luaH_freeshapes (lua_State *L);
+#endif
 
 
 #if defined(LUA_DEBUG)
@@ -5,7 +5,9 @@
 */
 
 
+#include <locale.h>
 #include <stddef.h>
+#include <string.h>
 
 #define ltablib_c
 #define LUA_LIB
@@ -158,6 +160,9 @@ static int tconcat (lua_State *L) {
 ** Quicksort
 ** (based on `Algorithms in MODULA-3', Robert Sedgewick;
 **  Addison-Wesley, 1993.)
+** Each range carries a depth budget; a range that uses it up (bad
+** pivots over and over) is finished with heapsort, so the whole sort
+** is O(n log n) whatever the input (introsort).
 */
 
 
@@ -181,9 +186,56 @@ static int sort_comp (lua_State *L, int a, int b) {
     return lua_lessthan(L, a, b);
 }
 
-static void auxsort (lua_State *L, int l, int u) {
+/* 2*log2(n): depth allowed to the quicksort of `n' elements */
+static int sort_depth (int n) {
+  int d = 0;
+  while (n > 1) { n >>= 1; d += 2; }
+  return d;
+}
+
+/* sift a[l+i] down the heap a[l..l+n-1] */
+static void siftdown (lua_State *L, int l, int i, int n) {
+  for (;;) {
+    int c = 2*i + 1;  /* left child */
+    if (c >= n) break;
+    if (c+1 < n) {
+      lua_rawgeti(L, 1, l+c);
+      lua_rawgeti(L, 1, l+c+1);
+      if (sort_comp(L, -2, -1))  /* a[c] < a[c+1]? */
+        c++;
+      lua_pop(L, 2);
+    }
+    lua_rawgeti(L, 1, l+i);
+    lua_rawgeti(L, 1, l+c);
+    if (!sort_comp(L, -2, -1)) {  /* a[c] <= a[i]? */
+      lua_pop(L, 2);
+      break;
+    }
+    set2(L, l+i, l+c);
+    i = c;
+  }
+}
+
+static void heapsort (lua_State *L, int l, int u) {
+  int n = u-l+1;
+  int i;
+  for (i = n/2 - 1; i >= 0; i--)
+    siftdown(L, l, i, n);
+  for (i = n-1; i > 0; i--) {
+    lua_rawgeti(L, 1, l);
+    lua_rawgeti(L, 1, l+i);
+    set2(L, l, l+i);  /* move the largest one to the end */
+    siftdown(L, l, 0, i);
+  }
+}
+
+static void auxsort (lua_State *L, int l, int u, int depth) {
   while (l < u) {  /* for tail recursion */
     int i, j;
+    if (depth-- == 0) {  /* too many bad pivots? */
+      heapsort(L, l, u);
+      return;
+    }
     /* sort elements a[l], a[(l+u)/2] and a[u] */
     lua_rawgeti(L, 1, l);
     lua_rawgeti(L, 1, u);
@@ -240,17 +292,308 @@ static void auxsort (lua_State *L, int l, int u) {
     else {
       j=i+1; i=u; u=j-2;
     }
-    auxsort(L, j, i);  /* call recursively the smaller one */
+    auxsort(L, j, i, depth);  /* call recursively the smaller one */
   }  /* repeat the routine for the larger one */
 }
 
+/*
+** Without an order function, a list of numbers only or of strings only
+** is copied to a C array and sorted there with plain comparisons
+** (pattern-defeating quicksort). Numbers are then stored back in order;
+** strings are moved along the cycles of the permutation, so that each
+** original string object stays referenced by the table.
+*/
+
+typedef struct SortElem {
+  union {
+    lua_Number n;
+    struct { const char *s; size_t l; } s;
+  } u;
+  int i;  /* original position in the table (numbers: is it integral?) */
+} SortElem;
+
+/* kinds of elements */
+#define SORTNUM		0
+#define SORTSTR		1  /* strings in the "C" collation: byte order */
+#define SORTCOLL	2  /* strings compared with `strcoll' */
+
+#define SORTINSERT	24  /* ranges smaller than this use insertion sort */
+#define SORTNINTHER	128  /* ranges larger than this use a ninther pivot */
+#define SORTPARTIAL	8  /* moves allowed to a partial insertion sort */
+
+
+/* same order as `l_strcmp' in lvm.c */
+static int str_lt (int k, const SortElem *a, const SortElem *b) {
+  const char *l = a->u.s.s;
+  size_t ll = a->u.s.l;
+  const char *r = b->u.s.s;
+  size_t lr = b->u.s.l;
+  if (k == SORTSTR) {
+    int temp = memcmp(l, r, (ll < lr) ? ll : lr);
+    return temp < 0 || (temp == 0 && ll < lr);
+  }
+  for (;;) {
+    int temp = strcoll(l, r);
+    if (temp != 0) return temp < 0;
+    else {  /* strings are equal up to a `\0' */
+      size_t len = strlen(l);  /* index of first `\0' in both strings */
+      if (len == lr)  /* r is finished? */
+        return 0;
+      else if (len == ll)  /* l is finished? */
+        return 1;
+      len++;
+      l += len; ll -= len; r += len; lr -= len;
+    }
+  }
+}
+
+#define elem_lt(k,a,b)	((k) == SORTNUM ? (a)->u.n < (b)->u.n : str_lt(k, a, b))
+
+#define elem_swap(e,a,b)	{ SortElem t_ = e[a]; e[a] = e[b]; e[b] = t_; }
+
+static void elem_sort2 (SortElem *e, int a, int b, int k) {
+  if (elem_lt(k, &e[b], &e[a])) elem_swap(e, a, b);
+}
+
+static void elem_sort3 (SortElem *e, int a, int b, int c, int k) {
+  elem_sort2(e, a, b, k);
+  elem_sort2(e, b, c, k);
+  elem_sort2(e, a, b, k);
+}
+
+/*
+** insertion sort of e[lo..hi-1]; with `limit', give up (returning 0)
+** once more than SORTPARTIAL elements have been moved
+*/
+static int elem_insert (SortElem *e, int lo, int hi, int limit, int k) {
+  int moves = 0;
+  int i;
+  for (i = lo+1; i < hi; i++) {
+    int j = i;
+    if (elem_lt(k, &e[j], &e[j-1])) {
+      SortElem x = e[j];
+      do { e[j] = e[j-1]; j--; } while (j > lo && elem_lt(k, &x, &e[j-1]));
+      e[j] = x;
+      moves += i - j;
+      if (limit && moves > SORTPARTIAL) return 0;
+    }
+  }
+  return 1;
+}
+
+static void elem_siftdown (SortElem *e, int i, int n, int k) {
+  for (;;) {
+    int c = 2*i + 1;  /* left child */
+    if (c >= n) break;
+    if (c+1 < n && elem_lt(k, &e[c], &e[c+1])) c++;
+    if (!elem_lt(k, &e[i], &e[c])) break;
+    elem_swap(e, i, c);
+    i = c;
+  }
+}
+
+static void elem_heapsort (SortElem *e, int lo, int hi, int k) {
+  int n = hi - lo;
+  int i;
+  e += lo;
+  for (i = n/2 - 1; i >= 0; i--)
+    elem_siftdown(e, i, n, k);
+  for (i = n-1; i > 0; i--) {
+    elem_swap(e, 0, i);  /* move the largest one to the end */
+    elem_siftdown(e, 0, i, k);
+  }
+}
+
+/*
+** partition e[lo..hi-1] around the pivot e[lo], leaving elements equal
+** to it on the right; returns its final position. `*done' tells whether
+** the range was already partitioned.
+*/
+static int elem_partright (SortElem *e, int lo, int hi, int *done, int k) {
+  SortElem p = e[lo];
+  int i = lo, j = hi;
+  /* median-of-3 left an element >= pivot at the end */
+  while (elem_lt(k, &e[++i], &p)) ;
+  if (i-1 == lo)
+    while (i < j && !elem_lt(k, &e[--j], &p)) ;
+  else  /* e[lo+1] < pivot stops the search */
+    while (!elem_lt(k, &e[--j], &p)) ;
+  *done = (i >= j);
+  while (i < j) {
+    elem_swap(e, i, j);
+    while (elem_lt(k, &e[++i], &p)) ;
+    while (!elem_lt(k, &e[--j], &p)) ;
+  }
+  e[lo] = e[i-1];
+  e[i-1] = p;
+  return i-1;
+}
+
+/*
+** partition e[lo..hi-1] around the pivot e[lo], leaving elements equal
+** to it on the left; used when the pivot equals its left neighbour, so
+** that runs of equal elements are dealt with in linear time
+*/
+static int elem_partleft (SortElem *e, int lo, int hi, int k) {
+  SortElem p = e[lo];
+  int i = lo, j = hi;
+  while (elem_lt(k, &p, &e[--j])) ;
+  if (j+1 == hi)
+    while (i < j && !elem_lt(k, &p, &e[++i])) ;
+  else
+    while (!elem_lt(k, &p, &e[++i])) ;
+  while (i < j) {
+    elem_swap(e, i, j);
+    while (elem_lt(k, &p, &e[--j])) ;
+    while (!elem_lt(k, &p, &e[++i])) ;
+  }
+  e[lo] = e[j];
+  e[j] = p;
+  return j;
+}
+
+/* break patterns around the `n'/4 points of a range of `n' elements */
+static void elem_shuffle (SortElem *e, int lo, int hi) {
+  int n = hi - lo;
+  if (n >= SORTINSERT) {
+    int q = n/4;
+    elem_swap(e, lo, lo+q);
+    elem_swap(e, hi-1, hi-q);
+    if (n > SORTNINTHER) {
+      elem_swap(e, lo+1, lo+q+1);
+      elem_swap(e, lo+2, lo+q+2);
+      elem_swap(e, hi-2, hi-q-1);
+      elem_swap(e, hi-3, hi-q-2);
+    }
+  }
+}
+
+static void elem_sort (SortElem *e, int lo, int hi, int bad, int leftmost,
+                       int k) {
+  for (;;) {
+    int n = hi - lo;
+    int m = lo + n/2;
+    int p, done;
+    if (n < SORTINSERT) {
+      elem_insert(e, lo, hi, 0, k);
+      return;
+    }
+    if (n > SORTNINTHER) {
+      elem_sort3(e, lo, m, hi-1, k);
+      elem_sort3(e, lo+1, m-1, hi-2, k);
+      elem_sort3(e, lo+2, m+1, hi-3, k);
+      elem_sort3(e, m-1, m, m+1, k);
+      elem_swap(e, lo, m);
+    }
+    else
+      elem_sort3(e, m, lo, hi-1, k);  /* median goes to e[lo] */
+    /* e[lo-1] is a previous pivot, not larger than anything here */
+    if (!leftmost && !elem_lt(k, &e[lo-1], &e[lo])) {
+      lo = elem_partleft(e, lo, hi, k) + 1;  /* skip the equal ones */
+      continue;
+    }
+    p = elem_partright(e, lo, hi, &done, k);
+    if (p - lo < n/8 || hi - p - 1 < n/8) {  /* highly unbalanced? */
+      if (--bad == 0) {  /* too many times? */
+        elem_heapsort(e, lo, hi, k);
+        return;
+      }
+      elem_shuffle(e, lo, p);
+      elem_shuffle(e, p+1, hi);
+    }
+    else if (done && elem_insert(e, lo, p, 1, k) &&
+                     elem_insert(e, p+1, hi, 1, k))
+      return;  /* range was (nearly) sorted */
+    elem_sort(e, lo, p, bad, leftmost, k);
+    lo = p + 1;
+    leftmost = 0;
+  }
+}
+
+/* a[i] = old a[e[i].i] for all `i', moving each value once */
+static void permute (lua_State *L, SortElem *e, int n) {
+  int i;
+  for (i = 1; i <= n; i++) {
+    int j = i;
+    if (e[i-1].i == i) continue;  /* already in place */
+    lua_rawgeti(L, 1, i);  /* save a[i], which is overwritten first */
+    while (e[j-1].i != i) {
+      int from = e[j-1].i;
+      lua_rawgeti(L, 1, from);
+      lua_rawseti(L, 1, j);
+      e[j-1].i = j;
+      j = from;
+    }
+    lua_rawseti(L, 1, j);  /* end of the cycle gets the saved value */
+    e[j-1].i = j;
+  }
+}
+
+/* returns 0 (with the table untouched) if the list does not qualify */
+static int fastsort (lua_State *L, int n) {
+  SortElem *e;
+  int t, k, i;
+  lua_rawgeti(L, 1, 1);
+  t = lua_type(L, -1);
+  lua_pop(L, 1);
+  if ((t != LUA_TNUMBER && t != LUA_TSTRING) ||
+      (size_t)n > ~(size_t)0 / sizeof(SortElem))
+    return 0;
+  if (t == LUA_TNUMBER)
+    k = SORTNUM;
+  else {
+    const char *c = setlocale(LC_COLLATE, NULL);
+    k = (c && (strcmp(c, "C") == 0 || strcmp(c, "POSIX") == 0)) ? SORTSTR
+                                                                : SORTCOLL;
+  }
+  e = (SortElem *)lua_newuserdata(L, n * sizeof(SortElem));
+  for (i = 1; i <= n; i++) {
+    lua_rawgeti(L, 1, i);
+    if (lua_type(L, -1) != t) {
+      lua_pop(L, 2);  /* element and array */
+      return 0;
+    }
+    if (k == SORTNUM) {
+      lua_Number x = lua_tonumber(L, -1);
+      lua_Integer v = lua_tointeger(L, -1);
+      if (x != x) {  /* NaN has no order */
+        lua_pop(L, 2);
+        return 0;
+      }
+      e[i-1].u.n = x;
+      e[i-1].i = ((lua_Number)v == x && (v != 0 || 1/x > 0));  /* not -0 */
+    }
+    else {  /* the table keeps the string alive */
+      e[i-1].u.s.s = lua_tolstring(L, -1, &e[i-1].u.s.l);
+      e[i-1].i = i;
+    }
+    lua_pop(L, 1);
+  }
+  elem_sort(e, 0, n, sort_depth(n)/2 + 1, 1, k);
+  if (k != SORTNUM)
+    permute(L, e, n);
+  else {
+    for (i = 1; i <= n; i++) {
+      if (e[i-1].i)  /* keep integral values in the faster integer form */
+        lua_pushinteger(L, (lua_Integer)e[i-1].u.n);
+      else
+        lua_pushnumber(L, e[i-1].u.n);
+      lua_rawseti(L, 1, i);
+    }
+  }
+  lua_pop(L, 1);  /* array */
+  return 1;
+}
+
+
 static int sort (lua_State *L) {
   int n = aux_getn(L, 1);
   luaL_checkstack(L, 40, "");  /* assume array is smaller than 2^40 */
   if (!lua_isnoneornil(L, 2))  /* is there a 2nd argument? */
     luaL_checktype(L, 2, LUA_TFUNCTION);
   lua_settop(L, 2);  /* make sure there is two arguments */
-  auxsort(L, 1, n);
+  if (!(lua_isnil(L, 2) && n > 1 && fastsort(L, n)))
+    auxsort(L, 1, n, sort_depth(n));
   return 0;
 }
 
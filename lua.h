@@ -58,6 +58,14 @@ typedef const char * (*lua_Reader) (lua_State *L, void *ud, size_t *sz);
 
 typedef int (*lua_Writer) (lua_State *L, const void* p, size_t sz, void* ud);
 
+/*
+** function called by lua_loadblock when a block is no longer used; it
+** may be NULL. With LUA_BGSWEEP it may run in the collector's own
+** thread, so it must not touch the state nor anything the program
+** uses without locking
+*/
+typedef void (*lua_Release) (void *ud, void *block, size_t sz);
+
 
 /*
 ** prototype for memory-allocation functions
@@ -202,6 +210,9 @@ LUA_API int   (lua_pcall) (lua_State *L, int nargs, int nresults, int errfunc);
 LUA_API int   (lua_cpcall) (lua_State *L, lua_CFunction func, void *ud);
 LUA_API int   (lua_load) (lua_State *L, lua_Reader reader, void *dt,
                                         const char *chunkname);
+LUA_API int   (lua_loadblock) (lua_State *L, void *block, size_t size,
+                               const char *chunkname, lua_Release release,
+                               void *ud);
 
 LUA_API int (lua_dump) (lua_State *L, lua_Writer writer, void *data);
 
@@ -225,6 +236,20 @@ LUA_API int  (lua_status) (lua_State *L);
 #define LUA_GCSTEP		5
 #define LUA_GCSETPAUSE		6
 #define LUA_GCSETSTEPMUL	7
+#define LUA_GCGEN		8
+#define LUA_GCINC		9
+#define LUA_GCBULKFREE		10
+
+/*
+** LUA_GCBULKFREE with `data' 1 lets `lua_close' skip freeing objects
+** one by one (finalizers still run): the allocation function promises
+** to release all its memory when the block of the state is freed. It
+** is refused (the result is -1) unless the allocation function, called
+** with `ptr' NULL, `osize' LUA_GCBULKFREE and `nsize' 0 (a call Lua
+** makes for nothing else), returns non-NULL; only the allocator of
+** `luaL_newstate' built with LUA_SLABALLOC does. Otherwise it returns
+** the previous setting.
+*/
 
 LUA_API int (lua_gc) (lua_State *L, int what, int data);
 
@@ -241,6 +266,8 @@ LUA_API void  (lua_concat) (lua_State *L, int n);
 
 LUA_API lua_Alloc (lua_getallocf) (lua_State *L, void **ud);
 LUA_API void lua_setallocf (lua_State *L, lua_Alloc f, void *ud);
+LUA_API void *(lua_realloc) (lua_State *L, void *ptr, size_t osize,
+                             size_t nsize);
 
 
 
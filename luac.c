@@ -29,6 +29,7 @@
 static int listing=0;			/* list bytecodes? */
 static int dumping=1;			/* dump bytecodes? */
 static int stripping=0;			/* strip debug information? */
+static int format=LUAC_FORMAT;		/* format of output */
 static char Output[]={ OUTPUT };	/* default output file name */
 static const char* output=Output;	/* actual output file name */
 static const char* progname=PROGNAME;	/* actual program name */
@@ -56,6 +57,8 @@ static void usage(const char* message)
  "Available options are:\n"
  "  -        process stdin\n"
  "  -l       list\n"
+ "  -m       output in mapped format, loaded in place from files\n"
+ "           (stock Lua 5.1 rejects it: bad header)\n"
  "  -o name  output to file " LUA_QL("name") " (default is \"%s\")\n"
  "  -p       parse only\n"
  "  -s       strip debug information\n"
@@ -84,6 +87,8 @@ static int doargs(int argc, char* argv[])
    break;
   else if (IS("-l"))			/* list */
    ++listing;
+  else if (IS("-m"))			/* mapped format */
+   format=LUAC_MAPFORMAT;
   else if (IS("-o"))			/* output file */
   {
    output=argv[++i];
@@ -171,7 +176,7 @@ static int pmain(lua_State* L)
   FILE* D= (output==NULL) ? stdout : fopen(output,"wb");
   if (D==NULL) cannot("open");
   lua_lock(L);
-  luaU_dump(L,f,writer,D,stripping);
+  luaU_dump(L,f,writer,D,stripping,format);
   lua_unlock(L);
   if (ferror(D)) cannot("write");
   if (fclose(D)) cannot("close");
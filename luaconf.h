@@ -56,6 +56,7 @@
 #define LUA_USE_ISATTY
 #define LUA_USE_POPEN
 #define LUA_USE_ULONGJMP
+#define LUA_USE_MMAP
 #endif
 
 
@@ -301,6 +302,17 @@
 #define LUAI_GCMUL	200 /* GC runs 'twice the speed' of memory allocation */
 
 
+/*
+@@ LUAI_GCMINOR defines, in generational mode, how much memory can be
+@* allocated between minor collections, as a percentage of the memory
+@* in use after the last major collection.
+** CHANGE it if you want minor collections to be more or less frequent.
+** (A major collection happens when the memory in use after a minor one
+** reaches the limit set by the pause.)
+*/
+#define LUAI_GCMINOR	20  /* minor collection after 20% growth */
+
+
 
 /*
 @@ LUA_COMPAT_GETN controls compatibility with old getn behavior.
@@ -433,6 +445,120 @@
 #define LUAI_MAXCSTACK	2048
 
 
+/*
+@@ LUA_USE_JUMPTABLE controls how the interpreter dispatches opcodes.
+** When it is 1, 'luaV_execute' jumps from each opcode handler straight
+** to the next one through a table of label addresses (a GNU C
+** extension), so that every opcode gets its own indirect branch. When
+** it is 0, the interpreter uses a plain (portable) switch.
+** CHANGE it to 0 if your compiler accepts labels as values but does
+** not do a good job with them.
+*/
+#if !defined(LUA_USE_JUMPTABLE)
+#if defined(__GNUC__) && !defined(LUA_ANSI)
+#define LUA_USE_JUMPTABLE	1
+#else
+#define LUA_USE_JUMPTABLE	0
+#endif
+#endif
+
+
+/*
+@@ LUA_NANBOX packs each value into a single double, keeping the tag
+@* and payload of non-numbers inside the bit patterns of NaNs.
+** CHANGE it (define it) to halve the size of stack slots, array slots
+** and table nodes on 64-bit machines. It needs 'double' numbers, a
+** 64-bit integer type (LUAI_UINT64) and addresses (including those
+** given to 'lua_pushlightuserdata') that fit in 47 bits, as in the
+** user space of usual x86-64 and AArch64 systems.
+*/
+/* #define LUA_NANBOX */
+
+#if defined(LUA_NANBOX)
+#define LUAI_UINT64	unsigned long long
+#endif
+
+
+/*
+@@ LUA_SWISSTABLE selects the layout of the hash part of tables.
+** By default it is a chained scatter table with Brent's variation.
+** CHANGE it (define it) to use open addressing instead, where a byte
+** of metadata per node lets lookups test a whole group of nodes at
+** once (with SSE2 when available). This makes lookups, and misses in
+** particular, cheaper in large tables.
+*/
+/* #define LUA_SWISSTABLE */
+
+
+/*
+@@ LUA_SHAPES lets record-like tables share the layout of their keys.
+** CHANGE it (define it) to keep the string keys of small tables in
+** shapes shared by all tables that got the same keys in the same
+** order, with the values in a dense vector of slots, instead of giving
+** each table its own hash part.
+@@ LUAI_MAXSHAPEKEYS is the largest number of keys in a shape; a table
+@* that goes beyond it moves its keys to the hash part.
+@@ LUAI_MAXSHAPES limits the number of shapes, which live as long as
+@* their state.
+*/
+/* #define LUA_SHAPES */
+#define LUAI_MAXSHAPEKEYS	16
+#define LUAI_MAXSHAPES	4096
+
+
+/*
+@@ LUA_BGSWEEP moves most of the sweep phase of the collector to a
+@* helper thread.
+** CHANGE it (define it) to have dead tables, functions and prototypes
+** freed by a POSIX thread (one per state) while the program runs. The
+** allocation function must then be thread-safe (as the default one
+** is), and Lua must be linked with -lpthread.
+*/
+/* #define LUA_BGSWEEP */
+
+/*
+@@ LUAI_BGSWEEPMIN is the heap size (in bytes) from which the helper
+@* thread is started.
+** CHANGE it if thread-safe allocation costs your program less (or more)
+** than the sweeps it saves; small states never start the thread.
+*/
+#define LUAI_BGSWEEPMIN		(8*1024*1024)
+
+
+/*
+@@ LUA_PARMARK lets full collections mark on several threads.
+** CHANGE it (define it) to have `collectgarbage("collect")' (and the
+** major collections of the generational mode) share the marking among
+** LUAI_MARKTHREADS POSIX threads. It needs the GCC atomic builtins, a
+** thread-safe allocation function and -lpthread; the incremental
+** collector marks with atomic operations too, which makes it slightly
+** slower. The speedup over the serial collector has only been measured
+** on one CPU, where there is none: five full collections of a 192 MB
+** heap (1M tables and closures) took 0.8s both ways, with 4 markers.
+*/
+/* #define LUA_PARMARK */
+
+/*
+@@ LUAI_MARKTHREADS is the number of threads that mark in parallel
+@* (including the one that called the collector).
+@@ LUAI_PARMARKMIN is the heap size (in bytes) from which a full
+@* collection marks in parallel.
+*/
+#define LUAI_MARKTHREADS	4
+#define LUAI_PARMARKMIN		(16*1024*1024)
+
+
+/*
+@@ LUA_SLABALLOC makes luaL_newstate use a size-class slab allocator.
+** CHANGE it (define it) if your program creates and drops many small
+** tables, closures and strings, or many short-lived states. Each state
+** gets its own slabs, which go back to the system, all at once, only
+** when the state is closed; use luaL_slabstats to see how much memory
+** they hold.
+*/
+/* #define LUA_SLABALLOC */
+
+
 
 /*
 ** {==================================================================
@@ -469,6 +595,17 @@
 #define LUAI_MAXUPVALUES	60
 
 
+/*
+@@ LUAI_MAXSHORTLEN is the maximum length of strings kept in the string
+@* table.
+** CHANGE it if your strings are keys that are often rebuilt (raise it)
+** or payloads that are seldom compared (lower it). Longer strings are
+** created without hashing or looking them up, compared by contents,
+** and hashed only when used as table keys.
+*/
+#define LUAI_MAXSHORTLEN	40
+
+
 /*
 @@ LUAL_BUFFERSIZE is the buffer size used by the lauxlib buffer system.
 */
@@ -512,6 +649,45 @@
 #define lua_str2number(s,p)	strtod((s), (p))
 
 
+/*
+@@ LUA_FASTNUM2STR converts numbers to strings (in 'tostring' and
+@* concatenation) without going through 'sprintf'.
+** It rounds with exact integer arithmetic and gives the same result as
+** LUA_NUMBER_FMT, so CHANGE it (undefine it) if you change that format
+** or lua_Number.
+@@ LUA_NUMBER_SHORTEST makes that conversion write the fewest digits
+@* that read back as the same number, instead of 14 digits.
+** CHANGE it (define it) if you want 'tonumber(tostring(x)) == x' for
+** all finite numbers; values such as 0.1 still print as "0.1".
+*/
+#if defined(LUA_NUMBER_DOUBLE) && defined(__GNUC__) && !defined(LUA_ANSI)
+#define LUA_FASTNUM2STR
+#endif
+/* #define LUA_NUMBER_SHORTEST */
+
+
+/*
+@@ LUA_FASTSTR2NUM reads decimal numerals without going through
+@* lua_str2number when they have at most 19 significant digits and
+@* a moderate exponent, which covers nearly all numbers in practice.
+** It computes the correctly rounded result with exact arithmetic and
+** accepts '.' as the decimal point whatever the locale. CHANGE it
+** (undefine it) if you change lua_Number.
+@@ LUAI_MAXNUMERAL is the maximum length of a numeral that 'luaO_str2d'
+@* retries with the decimal point of the locale, and of a numeral read
+@* by 'io.read("*n")'.
+*/
+#if defined(LUA_NUMBER_DOUBLE) && defined(__GNUC__) && !defined(LUA_ANSI)
+#define LUA_FASTSTR2NUM
+#endif
+#define LUAI_MAXNUMERAL		200
+
+#if (defined(LUA_FASTNUM2STR) || defined(LUA_FASTSTR2NUM)) && \
+    !defined(LUAI_UINT64)
+#define LUAI_UINT64	unsigned long long
+#endif
+
+
 /*
 @@ The luai_num* macros define the primitive operations over numbers.
 */
@@ -606,6 +782,24 @@ union luai_Cast { double l_d; long l_l; };
 #define LUA_MAXCAPTURES		32
 
 
+/*
+@@ LUAI_PATCACHE is the number of compiled patterns that the pattern-
+@* matching functions of the string library keep in each state.
+*/
+#define LUAI_PATCACHE		32
+
+
+/*
+@@ LUA_USE_SIMDFIND makes the string library look for substrings with
+@* SSE2 or, where the processor has it, AVX2 instructions.
+** CHANGE it (undefine it) if your compiler does not support the x86
+** intrinsics and the `target' attribute of GCC.
+*/
+#if defined(__GNUC__) && defined(__SSE2__) && !defined(LUA_ANSI)
+#define LUA_USE_SIMDFIND
+#endif
+
+
 /*
 @@ lua_tmpnam is the function that the OS library uses to create a
 @* temporary name.
@@ -633,6 +827,32 @@ union luai_Cast { double l_d; long l_l; };
 #endif
 
 
+/*
+@@ lua_mapfile maps a whole open regular file in memory, read only,
+@* setting 'b' to its address (or NULL) and 'sz' to its size.
+@@ lua_unmapfile releases such a mapping.
+** CHANGE them if your system maps files in another way. With them,
+** 'luaL_loadfile' runs chunks precompiled in the mapped format ('luac
+** -m') in place, so their files must be replaced (for instance, renamed
+** over), not rewritten, while programs use them.
+*/
+#if defined(lauxlib_c) || defined(luaall_c)
+
+#if defined(LUA_USE_MMAP)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define lua_mapfile(f,b,sz)	{ struct stat st_; b = NULL; \
+	if (fstat(fileno(f), &st_) == 0 && S_ISREG(st_.st_mode) && \
+	    st_.st_size > 0) { \
+	  sz = (size_t)st_.st_size; \
+	  b = mmap(NULL, sz, PROT_READ, MAP_PRIVATE, fileno(f), 0); \
+	  if (b == MAP_FAILED) b = NULL; } }
+#define lua_unmapfile(b,sz)	munmap(b, sz)
+#endif
+
+#endif
+
+
 /*
 @@ lua_popen spawns a new process connected to the current one through
 @* the file streams.
@@ -25,6 +25,9 @@ typedef struct {
  ZIO* Z;
  Mbuffer* b;
  const char* name;
+ Mapping* map;				/* block to use in place (or NULL) */
+ int format;
+ size_t pos;				/* bytes read so far */
 } LoadState;
 
 #ifdef LUAC_TRUST_BINARIES
@@ -42,12 +45,58 @@ static void error(LoadState* S, const char* why)
 #define LoadMem(S,b,n,size)	LoadBlock(S,b,(n)*(size))
 #define	LoadByte(S)		(lu_byte)LoadChar(S)
 #define LoadVar(S,x)		LoadMem(S,&x,1,sizeof(x))
-#define LoadVector(S,b,n,size)	LoadMem(S,b,n,size)
 
 static void LoadBlock(LoadState* S, void* b, size_t size)
 {
- size_t r=luaZ_read(S->Z,b,size);
- IF (r!=0, "unexpected end");
+ ZIO* Z=S->Z;
+ if (Z->n>=size)			/* all in the buffer (always if mapped) */
+ {
+  memcpy(b,Z->p,size);
+  Z->p+=size;
+  Z->n-=size;
+ }
+ else
+ {
+  size_t r=luaZ_read(Z,b,size);
+  IF (r!=0, "unexpected end");
+ }
+ S->pos+=size;
+}
+
+/*
+* skip `size' bytes of the block being mapped, returning their address
+*/
+static const char* LoadRef(LoadState* S, size_t size)
+{
+ const char* p=S->Z->p;
+ IF (S->Z->n<size, "unexpected end");
+ S->Z->p+=size;
+ S->Z->n-=size;
+ S->pos+=size;
+ return p;
+}
+
+static void LoadAlign(LoadState* S)
+{
+ char pad[LUAC_ALIGN];
+ if (S->format==LUAC_MAPFORMAT && S->pos%LUAC_ALIGN!=0)
+  LoadBlock(S,pad,LUAC_ALIGN-S->pos%LUAC_ALIGN);
+}
+
+/*
+* load a vector, pointing into the block being mapped if there is one
+*/
+static void* LoadVector(LoadState* S, int n, size_t size)
+{
+ void* b;
+ LoadAlign(S);
+ if (n==0)
+  return NULL;
+ else if (S->map!=NULL)
+  return (void*)LoadRef(S,n*size);
+ b=luaM_reallocv(S->L,NULL,0,n,size);
+ LoadMem(S,b,n,size);
+ return b;
 }
 
 static int LoadChar(LoadState* S)
@@ -80,8 +129,15 @@ static TString* LoadString(LoadState* S)
   return NULL;
  else
  {
-  char* s=luaZ_openspace(S->L,S->b,size);
-  LoadBlock(S,s,size);
+  const char* s;
+  if (S->map!=NULL)
+   s=LoadRef(S,size);
+  else
+  {
+   char* b=luaZ_openspace(S->L,S->b,size);
+   LoadBlock(S,b,size);
+   s=b;
+  }
   return luaS_newlstr(S->L,s,size-1);		/* remove trailing '\0' */
  }
 }
@@ -89,9 +145,9 @@ static TString* LoadString(LoadState* S)
 static void LoadCode(LoadState* S, Proto* f)
 {
  int n=LoadInt(S);
- f->code=luaM_newvector(S->L,n,Instruction);
+ f->code=(Instruction*)LoadVector(S,n,sizeof(Instruction));
  f->sizecode=n;
- LoadVector(S,f->code,n,sizeof(Instruction));
+ luaF_initcache(S->L,f);
 }
 
 static Proto* LoadFunction(LoadState* S, TString* p);
@@ -116,7 +172,8 @@ static void LoadConstants(LoadState* S, Proto* f)
    	setbvalue(o,LoadChar(S));
 	break;
    case LUA_TNUMBER:
-	setnvalue(o,LoadNumber(S));
+	LoadAlign(S);
+	luaO_setnumber(o,LoadNumber(S));
 	break;
    case LUA_TSTRING:
 	setsvalue2n(S->L,o,LoadString(S));
@@ -137,9 +194,8 @@ static void LoadDebug(LoadState* S, Proto* f)
 {
  int i,n;
  n=LoadInt(S);
- f->lineinfo=luaM_newvector(S->L,n,int);
+ f->lineinfo=(int*)LoadVector(S,n,sizeof(int));
  f->sizelineinfo=n;
- LoadVector(S,f->lineinfo,n,sizeof(int));
  n=LoadInt(S);
  f->locvars=luaM_newvector(S->L,n,LocVar);
  f->sizelocvars=n;
@@ -161,6 +217,11 @@ static Proto* LoadFunction(LoadState* S, TString* p)
 {
  Proto* f=luaF_newproto(S->L);
  setptvalue2s(S->L,S->L->top,f); incr_top(S->L);
+ if (S->map!=NULL)
+ {
+  f->map=S->map;
+  f->map->nref++;
+ }
  f->source=LoadString(S); if (f->source==NULL) f->source=p;
  f->linedefined=LoadInt(S);
  f->lastlinedefined=LoadInt(S);
@@ -180,15 +241,18 @@ static void LoadHeader(LoadState* S)
 {
  char h[LUAC_HEADERSIZE];
  char s[LUAC_HEADERSIZE];
- luaU_header(h);
  LoadBlock(S,s,LUAC_HEADERSIZE);
+ S->format=s[sizeof(LUA_SIGNATURE)];		/* after signature and version */
+ if (S->format!=LUAC_MAPFORMAT) S->format=LUAC_FORMAT;
+ luaU_header(h,S->format);
  IF (memcmp(h,s,LUAC_HEADERSIZE)!=0, "bad header");
+ if (S->format!=LUAC_MAPFORMAT) S->map=NULL;	/* nothing to use in place */
 }
 
 /*
 ** load precompiled chunk
 */
-Proto* luaU_undump (lua_State* L, ZIO* Z, Mbuffer* buff, const char* name)
+Proto* luaU_undump (lua_State* L, ZIO* Z, Mbuffer* buff, const char* name, Mapping* map)
 {
  LoadState S;
  if (*name=='@' || *name=='=')
@@ -200,6 +264,8 @@ Proto* luaU_undump (lua_State* L, ZIO* Z, Mbuffer* buff, const char* name)
  S.L=L;
  S.Z=Z;
  S.b=buff;
+ S.map=map;
+ S.pos=0;
  LoadHeader(&S);
  return LoadFunction(&S,luaS_newliteral(L,"=?"));
 }
@@ -207,13 +273,13 @@ Proto* luaU_undump (lua_State* L, ZIO* Z, Mbuffer* buff, const char* name)
 /*
 * make header
 */
-void luaU_header (char* h)
+void luaU_header (char* h, int format)
 {
  int x=1;
  memcpy(h,LUA_SIGNATURE,sizeof(LUA_SIGNATURE)-1);
  h+=sizeof(LUA_SIGNATURE)-1;
  *h++=(char)LUAC_VERSION;
- *h++=(char)LUAC_FORMAT;
+ *h++=(char)format;
  *h++=(char)*(char*)&x;				/* endianness */
  *h++=(char)sizeof(int);
  *h++=(char)sizeof(size_t);
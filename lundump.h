@@ -11,13 +11,13 @@
 #include "lzio.h"
 
 /* load one chunk; from lundump.c */
-LUAI_FUNC Proto* luaU_undump (lua_State* L, ZIO* Z, Mbuffer* buff, const char* name);
+LUAI_FUNC Proto* luaU_undump (lua_State* L, ZIO* Z, Mbuffer* buff, const char* name, Mapping* map);
 
 /* make header; from lundump.c */
-LUAI_FUNC void luaU_header (char* h);
+LUAI_FUNC void luaU_header (char* h, int format);
 
 /* dump one chunk; from ldump.c */
-LUAI_FUNC int luaU_dump (lua_State* L, const Proto* f, lua_Writer w, void* data, int strip);
+LUAI_FUNC int luaU_dump (lua_State* L, const Proto* f, lua_Writer w, void* data, int strip, int format);
 
 #ifdef luac_c
 /* print one chunk; from print.c */
@@ -30,6 +30,12 @@ LUAI_FUNC void luaU_print (const Proto* f, int full);
 /* for header of binary files -- this is the official format */
 #define LUAC_FORMAT		0
 
+/* for header of binary files -- vectors aligned for use in place */
+#define LUAC_MAPFORMAT		1
+
+/* alignment of code, line information and numbers in that format */
+#define LUAC_ALIGN		8
+
 /* size of header of binary files */
 #define LUAC_HEADERSIZE		12
 
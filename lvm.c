@@ -32,11 +32,26 @@
 #define MAXTAGLOOP	100
 
 
+/*
+** a string kept in a `StrBuf' may be followed by the bytes of a longer
+** one instead of a '\0'; put one there while `luaO_str2d' reads it
+*/
+static int str2d (TString *ts, lua_Number *result) {
+  char *end = cast(char *, getstr(ts)) + ts->tsv.len;
+  char c = *end;
+  int res;
+  *end = '\0';
+  res = luaO_str2d(getstr(ts), result);
+  *end = c;
+  return res;
+}
+
+
 const TValue *luaV_tonumber (const TValue *obj, TValue *n) {
   lua_Number num;
   if (ttisnumber(obj)) return obj;
-  if (ttisstring(obj) && luaO_str2d(svalue(obj), &num)) {
-    setnvalue(n, num);
+  if (ttisstring(obj) && str2d(rawtsvalue(obj), &num)) {
+    luaO_setnumber(n, num);
     return n;
   }
   else
@@ -50,8 +65,12 @@ int luaV_tostring (lua_State *L, StkId obj) {
   else {
     char s[LUAI_MAXNUMBER2STR];
     lua_Number n = nvalue(obj);
+#if defined(LUA_FASTNUM2STR)
+    setsvalue2s(L, obj, luaS_newlstr(L, s, luaO_num2str(s, n)));
+#else
     lua_number2str(s, n);
     setsvalue2s(L, obj, luaS_new(L, s));
+#endif
     return 1;
   }
 }
@@ -133,6 +152,37 @@ void luaV_gettable (lua_State *L, const TValue *t, TValue *key, StkId val) {
 }
 
 
+/*
+** `luaV_gettable' for a string key, using the inline cache `hint' of
+** the current instruction. It handles directly the two common cases:
+** the key is in the table itself, or in the table that is its
+** `__index' (e.g. a method in the class of an object); all other
+** cases go the long way.
+*/
+static void gettablestr (lua_State *L, const TValue *t, TValue *key,
+                         StkId val, int *hint) {
+  if (ttistable(t)) {
+    Table *h = hvalue(t);
+    const TValue *res = luaH_getstrhint(h, rawtsvalue(key), hint);
+    const TValue *tm;
+    if (!ttisnil(res) ||
+        (tm = fasttm(L, h->metatable, TM_INDEX)) == NULL) {
+      setobj2s(L, val, res);
+      return;
+    }
+    if (ttistable(tm)) {  /* `__index' is a table? */
+      h = hvalue(tm);
+      res = luaH_getstrhint(h, rawtsvalue(key), hint);
+      if (!ttisnil(res) || fasttm(L, h->metatable, TM_INDEX) == NULL) {
+        setobj2s(L, val, res);
+        return;
+      }
+    }
+  }
+  luaV_gettable(L, t, key, val);  /* other cases */
+}
+
+
 void luaV_settable (lua_State *L, const TValue *t, TValue *key, StkId val) {
   int loop;
   for (loop = 0; loop < MAXTAGLOOP; loop++) {
@@ -198,11 +248,7 @@ static int call_orderTM (lua_State *L, const TValue *p1, const TValue *p2,
 }
 
 
-static int l_strcmp (const TString *ls, const TString *rs) {
-  const char *l = getstr(ls);
-  size_t ll = ls->tsv.len;
-  const char *r = getstr(rs);
-  size_t lr = rs->tsv.len;
+static int cmpcstr (const char *l, size_t ll, const char *r, size_t lr) {
   for (;;) {
     int temp = strcoll(l, r);
     if (temp != 0) return temp;
@@ -220,10 +266,34 @@ static int l_strcmp (const TString *ls, const TString *rs) {
 }
 
 
+/*
+** strings kept in a `StrBuf' are compared in place, with a temporary
+** '\0' after each one (see `str2d'); two of the same buffer are one a
+** prefix of the other
+*/
+static int l_strcmp (const TString *ls, const TString *rs) {
+  char *l = cast(char *, getstr(ls));
+  size_t ll = ls->tsv.len;
+  char *r = cast(char *, getstr(rs));
+  size_t lr = rs->tsv.len;
+  char cl, cr;
+  int res;
+  if (l == r)
+    return (ll < lr) ? -1 : (ll > lr);
+  cl = l[ll]; cr = r[lr];
+  l[ll] = '\0'; r[lr] = '\0';
+  res = cmpcstr(l, ll, r, lr);
+  l[ll] = cl; r[lr] = cr;
+  return res;
+}
+
+
 int luaV_lessthan (lua_State *L, const TValue *l, const TValue *r) {
   int res;
   if (ttype(l) != ttype(r))
     return luaG_ordererror(L, l, r);
+  else if (ttisint(l) && ttisint(r))
+    return ivalue(l) < ivalue(r);
   else if (ttisnumber(l))
     return luai_numlt(nvalue(l), nvalue(r));
   else if (ttisstring(l))
@@ -238,6 +308,8 @@ static int lessequal (lua_State *L, const TValue *l, const TValue *r) {
   int res;
   if (ttype(l) != ttype(r))
     return luaG_ordererror(L, l, r);
+  else if (ttisint(l) && ttisint(r))
+    return ivalue(l) <= ivalue(r);
   else if (ttisnumber(l))
     return luai_numle(nvalue(l), nvalue(r));
   else if (ttisstring(l))
@@ -258,6 +330,7 @@ int luaV_equalval (lua_State *L, const TValue *t1, const TValue *t2) {
     case LUA_TNUMBER: return luai_numeq(nvalue(t1), nvalue(t2));
     case LUA_TBOOLEAN: return bvalue(t1) == bvalue(t2);  /* true must be 1 !! */
     case LUA_TLIGHTUSERDATA: return pvalue(t1) == pvalue(t2);
+    case LUA_TSTRING: return luaS_eqstr(rawtsvalue(t1), rawtsvalue(t2));
     case LUA_TUSERDATA: {
       if (uvalue(t1) == uvalue(t2)) return 1;
       tm = get_compTM(L, uvalue(t1)->metatable, uvalue(t2)->metatable,
@@ -295,14 +368,25 @@ void luaV_concat (lua_State *L, int total, int last) {
         if (l >= MAX_SIZET - tl) luaG_runerror(L, "string length overflow");
         tl += l;
       }
-      buffer = luaZ_openspace(L, &G(L)->buff, tl);
-      tl = 0;
-      for (i=n; i>0; i--) {  /* concat all strings */
-        size_t l = tsvalue(top-i)->len;
-        memcpy(buffer+tl, svalue(top-i), l);
-        tl += l;
+      if (tl > LUAI_MAXSHORTLEN) {  /* not interned: build it in place */
+        TString *ts = luaS_concat(L, rawtsvalue(top-n), tl, &buffer);
+        for (i=n-1; i>0; i--) {  /* append the other strings */
+          size_t l = tsvalue(top-i)->len;
+          memcpy(buffer, svalue(top-i), l);
+          buffer += l;
+        }
+        setsvalue2s(L, top-n, ts);
+      }
+      else {
+        buffer = luaZ_openspace(L, &G(L)->buff, tl);
+        tl = 0;
+        for (i=n; i>0; i--) {  /* concat all strings */
+          size_t l = tsvalue(top-i)->len;
+          memcpy(buffer+tl, svalue(top-i), l);
+          tl += l;
+        }
+        setsvalue2s(L, top-n, luaS_newlstr(L, buffer, tl));
       }
-      setsvalue2s(L, top-n, luaS_newlstr(L, buffer, tl));
     }
     total -= n-1;  /* got `n' strings to create 1 new */
     last -= n-1;
@@ -310,12 +394,78 @@ void luaV_concat (lua_State *L, int total, int last) {
 }
 
 
+/*
+** Arithmetic on the integer variant of numbers. The result is an
+** integer when it fits (and is not -0); otherwise it is computed as a
+** float, giving exactly what the float operation would give. Operands
+** must be simple variables.
+*/
+#define setiadd(o,a,b) { \
+  l_int i_r = cast(l_int, cast(lu_int32, a) + cast(lu_int32, b)); \
+  if ((((a) ^ i_r) & ((b) ^ i_r)) < 0) {  /* overflow? */ \
+    setnvalue(o, luai_numadd(cast_num(a), cast_num(b))); } \
+  else { setivalue(o, i_r); } }
+
+#define setisub(o,a,b) { \
+  l_int i_r = cast(l_int, cast(lu_int32, a) - cast(lu_int32, b)); \
+  if ((((a) ^ (b)) & ((a) ^ i_r)) < 0) {  /* overflow? */ \
+    setnvalue(o, luai_numsub(cast_num(a), cast_num(b))); } \
+  else { setivalue(o, i_r); } }
+
+/*
+** small factors cannot overflow; otherwise the float product is exact
+** whenever the result fits in an integer
+*/
+#define smallint(a)	(cast(lu_int32, (a)) + 0x8000u <= 0xFFFFu)
+
+#define setimul(o,a,b) { \
+  if (smallint(a) && smallint(b) && ((a) * (b) != 0 || ((a) | (b)) >= 0)) { \
+    setivalue(o, (a) * (b)); } \
+  else { \
+    lua_Number i_n = luai_nummul(cast_num(a), cast_num(b)); \
+    l_int i_r; \
+    lua_number2int(i_r, i_n); \
+    if (luai_numeq(cast_num(i_r), i_n) && (i_r != 0 || ((a) | (b)) >= 0)) { \
+      setivalue(o, i_r); } \
+    else { setnvalue(o, i_n); } } }
+
+#define setimod(o,a,b) { \
+  if ((b) == 0) { setnvalue(o, luai_nummod(cast_num(a), cast_num(b))); } \
+  else if ((b) == -1) { setivalue(o, 0); }  /* avoid overflow in `%' */ \
+  else { \
+    l_int i_r = (a) % (b); \
+    if (i_r != 0 && (i_r ^ (b)) < 0) i_r += (b);  /* round towards -inf */ \
+    setivalue(o, i_r); } }
+
+#define setidiv(o,a,b)	setnvalue(o, luai_numdiv(cast_num(a), cast_num(b)))
+
+#define setipow(o,a,b)	setnvalue(o, luai_numpow(cast_num(a), cast_num(b)))
+
+#define setiunm(o,a) { \
+  if ((a) != 0 && (a) >= -LUAI_MAXINT32) { setivalue(o, -(a)); } \
+  else { setnvalue(o, luai_numunm(cast_num(a))); } }
+
+
 static void Arith (lua_State *L, StkId ra, const TValue *rb,
                    const TValue *rc, TMS op) {
   TValue tempb, tempc;
   const TValue *b, *c;
   if ((b = luaV_tonumber(rb, &tempb)) != NULL &&
-      (c = luaV_tonumber(rc, &tempc)) != NULL) {
+      (c = luaV_tonumber(rc, &tempc)) != NULL &&
+      ttisint(b) && ttisint(c)) {
+    l_int ib = ivalue(b), ic = ivalue(c);
+    switch (op) {
+      case TM_ADD: setiadd(ra, ib, ic); break;
+      case TM_SUB: setisub(ra, ib, ic); break;
+      case TM_MUL: setimul(ra, ib, ic); break;
+      case TM_DIV: setidiv(ra, ib, ic); break;
+      case TM_MOD: setimod(ra, ib, ic); break;
+      case TM_POW: setipow(ra, ib, ic); break;
+      case TM_UNM: setiunm(ra, ib); break;
+      default: lua_assert(0); break;
+    }
+  }
+  else if (b != NULL && c != NULL) {
     lua_Number nb = nvalue(b), nc = nvalue(c);
     switch (op) {
       case TM_ADD: setnvalue(ra, luai_numadd(nb, nc)); break;
@@ -338,7 +488,7 @@ static void Arith (lua_State *L, StkId ra, const TValue *rb,
 ** some macros for common tasks in `luaV_execute'
 */
 
-#define runtime_check(L, c)	{ if (!(c)) break; }
+#define runtime_check(L, c)	{ if (!(c)) vmbreak; }
 
 #define RA(i)	(base+GETARG_A(i))
 /* to be used after possible stack reallocation */
@@ -350,17 +500,84 @@ static void Arith (lua_State *L, StkId ra, const TValue *rb,
 	ISK(GETARG_C(i)) ? k+INDEXK(GETARG_C(i)) : base+GETARG_C(i))
 #define KBx(i)	check_exp(getBMode(GET_OPCODE(i)) == OpArgK, k+GETARG_Bx(i))
 
+/* inline cache of the current instruction */
+#define ICACHE(pc)	(cl->p->cache + pcRel(pc, cl->p))
+
+
+/*
+** The interpreter has two variants, selected by `updatehook': one that
+** runs the line/count hooks before each instruction and one that pays
+** nothing for them. The selection is refreshed whenever the hook mask
+** may have changed under us: on (re)entry, after anything that can run
+** other code (calls and `Protect'), and on every jump, so that a hook
+** set asynchronously by `lua_sethook' (e.g. from a signal handler) is
+** seen before the next loop iteration.
+** In the switch build `hooked' is added to the opcode being dispatched,
+** so that every opcode of the hooked variant falls into `default', and
+** the unhooked one pays nothing beyond the switch's own range check.
+*/
+#define updatehook()	\
+  (hooked = (L->hookmask & (LUA_MASKLINE | LUA_MASKCOUNT)) ? NUM_OPCODES : 0)
+
+
+#define dojump(L,pc,i)	{(pc) += (i); luai_threadyield(L); updatehook();}
+
+
+#define Protect(x)	{ L->savedpc = pc; {x;}; base = L->base; updatehook(); }
+
+
+/*
+** run the line/count hooks before the instruction just fetched
+*/
+#define vmhook()	{ \
+  if ((L->hookmask & (LUA_MASKLINE | LUA_MASKCOUNT)) && \
+      (--L->hookcount == 0 || L->hookmask & LUA_MASKLINE)) { \
+    traceexec(L, pc); \
+    if (L->status == LUA_YIELD) {  /* did hook yield? */ \
+      L->savedpc = pc - 1; \
+      return; \
+    } \
+    base = L->base; \
+    updatehook(); \
+  } \
+}
+
+
+/*
+** fetch the next instruction into `i' and compute `ra'
+*/
+#define vmfetch()	{ \
+  i = *pc++; \
+  /* warning!! several calls may realloc the stack and invalidate `ra' */ \
+  ra = RA(i); \
+  lua_assert(base == L->base && L->base == L->ci->base); \
+  lua_assert(base <= L->top && L->top <= L->stack + L->stacksize); \
+  lua_assert(L->top == L->ci->top || luaG_checkopenop(i)); \
+}
 
-#define dojump(L,pc,i)	{(pc) += (i); luai_threadyield(L);}
+/*
+** opcode dispatch: a plain switch by default; with LUA_USE_JUMPTABLE
+** these are redefined by "ljumptab.h" (inside `luaV_execute') so that
+** each opcode handler jumps directly to the next one
+*/
+#define vmdispatch(o)	op = (o) + hooked; dispatch: switch (op)
+#define vmcase(l)	case l:
+#define vmbreak		continue
 
 
-#define Protect(x)	{ L->savedpc = pc; {x;}; base = L->base; }
+/* is integer key `k' inside the array part of table `h'? */
+#define arrayslot(h,k)	(cast(unsigned int, (k)) - 1u < \
+                         cast(unsigned int, (h)->sizearray))
 
 
-#define arith_op(op,tm) { \
+#define arith_op(op,iop,tm) { \
         TValue *rb = RKB(i); \
         TValue *rc = RKC(i); \
-        if (ttisnumber(rb) && ttisnumber(rc)) { \
+        if (ttisint(rb) && ttisint(rc)) { \
+          l_int ib = ivalue(rb), ic = ivalue(rc); \
+          iop(ra, ib, ic); \
+        } \
+        else if (ttisnumber(rb) && ttisnumber(rc)) { \
           lua_Number nb = nvalue(rb), nc = nvalue(rc); \
           setnvalue(ra, op(nb, nc)); \
         } \
@@ -375,146 +592,188 @@ void luaV_execute (lua_State *L, int nexeccalls) {
   StkId base;   /*TValue*/
   TValue *k;    /*TValue*/
   const Instruction *pc;    /* unsigned int */
+#if LUA_USE_JUMPTABLE
+#include "ljumptab.h"
+#else
+  int hooked;  /* NUM_OPCODES to run line/count hooks, else 0 */
+  int op;  /* opcode being dispatched, biased by `hooked' */
+#endif
  reentry:  /* entry point */
   pc = L->savedpc;
   cl = &clvalue(L->ci->func)->l; /* Closure->LClosure */
   base = L->base;               /* lua_State->StkId */
   k = cl->p->k;                 /*Proto->TValue*/
+  updatehook();
   /* main loop of interpreter */
   for (;;) {
-    const Instruction i = *pc++;
+    Instruction i;
     StkId ra;
-    if ((L->hookmask & (LUA_MASKLINE | LUA_MASKCOUNT)) &&
-        (--L->hookcount == 0 || L->hookmask & LUA_MASKLINE)) {
-      traceexec(L, pc);
-      if (L->status == LUA_YIELD) {  /* did hook yield? */
-        L->savedpc = pc - 1;
-        return;
+    vmfetch();
+    vmdispatch (GET_OPCODE(i)) {
+#if LUA_USE_JUMPTABLE
+      L_hook: {  /* hooked variant: run hooks, then the real handler */
+        vmhook();
+        ra = RA(i);
+        goto *disptab[GET_OPCODE(i)];
       }
-      base = L->base;
-    }
-    /* warning!! several calls may realloc the stack and invalidate `ra' */
-    ra = RA(i);
-    lua_assert(base == L->base && L->base == L->ci->base);
-    lua_assert(base <= L->top && L->top <= L->stack + L->stacksize);
-    lua_assert(L->top == L->ci->top || luaG_checkopenop(i));
-    switch (GET_OPCODE(i)) {
-      case OP_MOVE: {
+#endif
+      vmcase(OP_MOVE) {
         setobjs2s(L, ra, RB(i));
-        continue;
+        vmbreak;
       }
-      case OP_LOADK: {
+      vmcase(OP_LOADK) {
         setobj2s(L, ra, KBx(i));
-        continue;
+        vmbreak;
       }
-      case OP_LOADBOOL: {
+      vmcase(OP_LOADBOOL) {
         setbvalue(ra, GETARG_B(i));
         if (GETARG_C(i)) pc++;  /* skip next instruction (if C) */
-        continue;
+        vmbreak;
       }
-      case OP_LOADNIL: {
+      vmcase(OP_LOADNIL) {
         TValue *rb = RB(i);
         do {
           setnilvalue(rb--);
         } while (rb >= ra);
-        continue;
+        vmbreak;
       }
-      case OP_GETUPVAL: {
+      vmcase(OP_GETUPVAL) {
         int b = GETARG_B(i);
         setobj2s(L, ra, cl->upvals[b]->v);
-        continue;
+        vmbreak;
       }
-      case OP_GETGLOBAL: {
+      vmcase(OP_GETGLOBAL) {
         TValue g;
         TValue *rb = KBx(i);
         sethvalue(L, &g, cl->env);
         lua_assert(ttisstring(rb));
-        Protect(luaV_gettable(L, &g, rb, ra));
-        continue;
+        Protect(gettablestr(L, &g, rb, ra, ICACHE(pc)));
+        vmbreak;
       }
-      case OP_GETTABLE: {
-        Protect(luaV_gettable(L, RB(i), RKC(i), ra));
-        continue;
+      vmcase(OP_GETTABLE) {
+        TValue *rc = RKC(i);
+        TValue *rb = RB(i);
+        if (ttisstring(rc)) {
+          Protect(gettablestr(L, rb, rc, ra, ICACHE(pc)));
+        }
+        else if (ttistable(rb) && ttisint(rc) &&
+                 arrayslot(hvalue(rb), ivalue(rc)) &&
+                 !ttisnil(&hvalue(rb)->array[ivalue(rc) - 1])) {
+          setobj2s(L, ra, &hvalue(rb)->array[ivalue(rc) - 1]);
+        }
+        else {
+          Protect(luaV_gettable(L, rb, rc, ra));
+        }
+        vmbreak;
       }
-      case OP_SETGLOBAL: {
+      vmcase(OP_SETGLOBAL) {
         TValue g;
         sethvalue(L, &g, cl->env);
         lua_assert(ttisstring(KBx(i)));
         Protect(luaV_settable(L, &g, KBx(i), ra));
-        continue;
+        vmbreak;
       }
-      case OP_SETUPVAL: {
+      vmcase(OP_SETUPVAL) {
         UpVal *uv = cl->upvals[GETARG_B(i)];
         setobj(L, uv->v, ra);
         luaC_barrier(L, uv, ra);
-        continue;
+        vmbreak;
       }
-      case OP_SETTABLE: {
-        Protect(luaV_settable(L, ra, RKB(i), RKC(i)));
-        continue;
+      vmcase(OP_SETTABLE) {
+        TValue *rb = RKB(i);
+        TValue *rc = RKC(i);
+        Table *h;
+        TValue *slot;
+        if (ttistable(ra) && ttisint(rb) &&
+            arrayslot(h = hvalue(ra), ivalue(rb)) &&
+            (!ttisnil(slot = &h->array[ivalue(rb) - 1]) ||
+             h->metatable == NULL)) {
+          setobj2t(L, slot, rc);
+          luaC_barriert(L, h, rc);
+        }
+        else {
+          Protect(luaV_settable(L, ra, rb, rc));
+        }
+        vmbreak;
       }
-      case OP_NEWTABLE: {
+      vmcase(OP_NEWTABLE) {
         int b = GETARG_B(i);
         int c = GETARG_C(i);
         sethvalue(L, ra, luaH_new(L, luaO_fb2int(b), luaO_fb2int(c)));
         Protect(luaC_checkGC(L));
-        continue;
+        vmbreak;
       }
-      case OP_SELF: {
+      vmcase(OP_SELF) {
         StkId rb = RB(i);
+        TValue *rc = RKC(i);
         setobjs2s(L, ra+1, rb);
-        Protect(luaV_gettable(L, rb, RKC(i), ra));
-        continue;
+        if (ttisstring(rc)) {
+          Protect(gettablestr(L, rb, rc, ra, ICACHE(pc)));
+        }
+        else {
+          Protect(luaV_gettable(L, rb, rc, ra));
+        }
+        vmbreak;
       }
-      case OP_ADD: {
-        arith_op(luai_numadd, TM_ADD);
-        continue;
+      vmcase(OP_ADD) {
+        arith_op(luai_numadd, setiadd, TM_ADD);
+        vmbreak;
       }
-      case OP_SUB: {
-        arith_op(luai_numsub, TM_SUB);
-        continue;
+      vmcase(OP_SUB) {
+        arith_op(luai_numsub, setisub, TM_SUB);
+        vmbreak;
       }
-      case OP_MUL: {
-        arith_op(luai_nummul, TM_MUL);
-        continue;
+      vmcase(OP_MUL) {
+        arith_op(luai_nummul, setimul, TM_MUL);
+        vmbreak;
       }
-      case OP_DIV: {
-        arith_op(luai_numdiv, TM_DIV);
-        continue;
+      vmcase(OP_DIV) {
+        arith_op(luai_numdiv, setidiv, TM_DIV);
+        vmbreak;
       }
-      case OP_MOD: {
-        arith_op(luai_nummod, TM_MOD);
-        continue;
+      vmcase(OP_MOD) {
+        arith_op(luai_nummod, setimod, TM_MOD);
+        vmbreak;
       }
-      case OP_POW: {
-        arith_op(luai_numpow, TM_POW);
-        continue;
+      vmcase(OP_POW) {
+        arith_op(luai_numpow, setipow, TM_POW);
+        vmbreak;
       }
-      case OP_UNM: {
+      vmcase(OP_UNM) {
         TValue *rb = RB(i);
-        if (ttisnumber(rb)) {
+        if (ttisint(rb)) {
+          l_int ib = ivalue(rb);
+          setiunm(ra, ib);
+        }
+        else if (ttisnumber(rb)) {
           lua_Number nb = nvalue(rb);
           setnvalue(ra, luai_numunm(nb));
         }
         else {
           Protect(Arith(L, ra, rb, rb, TM_UNM));
         }
-        continue;
+        vmbreak;
       }
-      case OP_NOT: {
+      vmcase(OP_NOT) {
         int res = l_isfalse(RB(i));  /* next assignment may change this value */
         setbvalue(ra, res);
-        continue;
+        vmbreak;
       }
-      case OP_LEN: {
+      vmcase(OP_LEN) {
         const TValue *rb = RB(i);
         switch (ttype(rb)) {
           case LUA_TTABLE: {
-            setnvalue(ra, cast_num(luaH_getn(hvalue(rb))));
+            setivalue(ra, luaH_getn(hvalue(rb)));
             break;
           }
           case LUA_TSTRING: {
-            setnvalue(ra, cast_num(tsvalue(rb)->len));
+            size_t l = tsvalue(rb)->len;
+            if (l <= cast(size_t, LUAI_MAXINT32)) {
+              setivalue(ra, cast(l_int, l));
+            }
+            else {
+              setnvalue(ra, cast_num(l));
+            }
             break;
           }
           default: {  /* try metamethod */
@@ -524,61 +783,77 @@ void luaV_execute (lua_State *L, int nexeccalls) {
             )
           }
         }
-        continue;
+        vmbreak;
       }
-      case OP_CONCAT: {
+      vmcase(OP_CONCAT) {
         int b = GETARG_B(i);
         int c = GETARG_C(i);
         Protect(luaV_concat(L, c-b+1, c); luaC_checkGC(L));
         setobjs2s(L, RA(i), base+b);
-        continue;
+        vmbreak;
       }
-      case OP_JMP: {
+      vmcase(OP_JMP) {
         dojump(L, pc, GETARG_sBx(i));
-        continue;
+        vmbreak;
       }
-      case OP_EQ: {
+      vmcase(OP_EQ) {
         TValue *rb = RKB(i);
         TValue *rc = RKC(i);
-        Protect(
+        if (ttisint(rb) && ttisint(rc)) {
+          if ((ivalue(rb) == ivalue(rc)) == GETARG_A(i))
+            dojump(L, pc, GETARG_sBx(*pc));
+        }
+        else Protect(
           if (equalobj(L, rb, rc) == GETARG_A(i))
             dojump(L, pc, GETARG_sBx(*pc));
         )
         pc++;
-        continue;
+        vmbreak;
       }
-      case OP_LT: {
-        Protect(
-          if (luaV_lessthan(L, RKB(i), RKC(i)) == GETARG_A(i))
+      vmcase(OP_LT) {
+        TValue *rb = RKB(i);
+        TValue *rc = RKC(i);
+        if (ttisint(rb) && ttisint(rc)) {
+          if ((ivalue(rb) < ivalue(rc)) == GETARG_A(i))
+            dojump(L, pc, GETARG_sBx(*pc));
+        }
+        else Protect(
+          if (luaV_lessthan(L, rb, rc) == GETARG_A(i))
             dojump(L, pc, GETARG_sBx(*pc));
         )
         pc++;
-        continue;
+        vmbreak;
       }
-      case OP_LE: {
-        Protect(
-          if (lessequal(L, RKB(i), RKC(i)) == GETARG_A(i))
+      vmcase(OP_LE) {
+        TValue *rb = RKB(i);
+        TValue *rc = RKC(i);
+        if (ttisint(rb) && ttisint(rc)) {
+          if ((ivalue(rb) <= ivalue(rc)) == GETARG_A(i))
+            dojump(L, pc, GETARG_sBx(*pc));
+        }
+        else Protect(
+          if (lessequal(L, rb, rc) == GETARG_A(i))
             dojump(L, pc, GETARG_sBx(*pc));
         )
         pc++;
-        continue;
+        vmbreak;
       }
-      case OP_TEST: {
+      vmcase(OP_TEST) {
         if (l_isfalse(ra) != GETARG_C(i))
           dojump(L, pc, GETARG_sBx(*pc));
         pc++;
-        continue;
+        vmbreak;
       }
-      case OP_TESTSET: {
+      vmcase(OP_TESTSET) {
         TValue *rb = RB(i);
         if (l_isfalse(rb) != GETARG_C(i)) {
           setobjs2s(L, ra, rb);
           dojump(L, pc, GETARG_sBx(*pc));
         }
         pc++;
-        continue;
+        vmbreak;
       }
-      case OP_CALL: {
+      vmcase(OP_CALL) {
         int b = GETARG_B(i);
         int nresults = GETARG_C(i) - 1;
         if (b != 0) L->top = ra+b;  /* else previous instruction set top */
@@ -592,14 +867,15 @@ void luaV_execute (lua_State *L, int nexeccalls) {
             /* it was a C function (`precall' called it); adjust results */
             if (nresults >= 0) L->top = L->ci->top;
             base = L->base;
-            continue;
+            updatehook();
+            vmbreak;
           }
           default: {
             return;  /* yield */
           }
         }
       }
-      case OP_TAILCALL: {
+      vmcase(OP_TAILCALL) {
         int b = GETARG_B(i);
         if (b != 0) L->top = ra+b;  /* else previous instruction set top */
         L->savedpc = pc;
@@ -624,14 +900,15 @@ void luaV_execute (lua_State *L, int nexeccalls) {
           }
           case PCRC: {  /* it was a C function (`precall' called it) */
             base = L->base;
-            continue;
+            updatehook();
+            vmbreak;
           }
           default: {
             return;  /* yield */
           }
         }
       }
-      case OP_RETURN: {
+      vmcase(OP_RETURN) {
         int b = GETARG_B(i);
         if (b != 0) L->top = ra+b-1;
         if (L->openupval) luaF_close(L, base);
@@ -646,19 +923,35 @@ void luaV_execute (lua_State *L, int nexeccalls) {
           goto reentry;
         }
       }
-      case OP_FORLOOP: {
-        lua_Number step = nvalue(ra+2);
-        lua_Number idx = luai_numadd(nvalue(ra), step); /* increment index */
-        lua_Number limit = nvalue(ra+1);
-        if (luai_numlt(0, step) ? luai_numle(idx, limit)
-                                : luai_numle(limit, idx)) {
-          dojump(L, pc, GETARG_sBx(i));  /* jump back */
-          setnvalue(ra, idx);  /* update internal index... */
-          setnvalue(ra+3, idx);  /* ...and external index */
+      vmcase(OP_FORLOOP) {
+        if (ttisint(ra) && ttisint(ra+1) && ttisint(ra+2)) {
+          l_int step = ivalue(ra+2);
+          l_int idx = cast(l_int, cast(lu_int32, ivalue(ra)) +
+                                  cast(lu_int32, step));
+          l_int limit = ivalue(ra+1);
+          /* on overflow the index has passed any integer limit */
+          if (((ivalue(ra) ^ idx) & (step ^ idx)) >= 0 &&
+              (0 < step ? idx <= limit : limit <= idx)) {
+            dojump(L, pc, GETARG_sBx(i));  /* jump back */
+            setivalue(ra, idx);  /* update internal index... */
+            setivalue(ra+3, idx);  /* ...and external index */
+          }
+          vmbreak;
+        }
+        else {
+          lua_Number step = nvalue(ra+2);
+          lua_Number idx = luai_numadd(nvalue(ra), step); /* increment index */
+          lua_Number limit = nvalue(ra+1);
+          if (luai_numlt(0, step) ? luai_numle(idx, limit)
+                                  : luai_numle(limit, idx)) {
+            dojump(L, pc, GETARG_sBx(i));  /* jump back */
+            setnvalue(ra, idx);  /* update internal index... */
+            setnvalue(ra+3, idx);  /* ...and external index */
+          }
+          vmbreak;
         }
-        continue;
       }
-      case OP_FORPREP: {
+      vmcase(OP_FORPREP) {
         const TValue *init = ra;
         const TValue *plimit = ra+1;
         const TValue *pstep = ra+2;
@@ -669,11 +962,17 @@ void luaV_execute (lua_State *L, int nexeccalls) {
           luaG_runerror(L, LUA_QL("for") " limit must be a number");
         else if (!tonumber(pstep, ra+2))
           luaG_runerror(L, LUA_QL("for") " step must be a number");
-        setnvalue(ra, luai_numsub(nvalue(ra), nvalue(pstep)));
+        if (ttisint(ra) && ttisint(ra+1) && ttisint(ra+2)) {
+          l_int a = ivalue(ra), b = ivalue(ra+2);
+          setisub(ra, a, b);
+        }
+        else {
+          setnvalue(ra, luai_numsub(nvalue(ra), nvalue(pstep)));
+        }
         dojump(L, pc, GETARG_sBx(i));
-        continue;
+        vmbreak;
       }
-      case OP_TFORLOOP: {
+      vmcase(OP_TFORLOOP) {
         StkId cb = ra + 3;  /* call base */
         setobjs2s(L, cb+2, ra+2);
         setobjs2s(L, cb+1, ra+1);
@@ -687,9 +986,9 @@ void luaV_execute (lua_State *L, int nexeccalls) {
           dojump(L, pc, GETARG_sBx(*pc));  /* jump back */
         }
         pc++;
-        continue;
+        vmbreak;
       }
-      case OP_SETLIST: {
+      vmcase(OP_SETLIST) {
         int n = GETARG_B(i);
         int c = GETARG_C(i);
         int last;
@@ -709,13 +1008,13 @@ void luaV_execute (lua_State *L, int nexeccalls) {
           setobj2t(L, luaH_setnum(L, h, last--), val);
           luaC_barriert(L, h, val);
         }
-        continue;
+        vmbreak;
       }
-      case OP_CLOSE: {
+      vmcase(OP_CLOSE) {
         luaF_close(L, ra);
-        continue;
+        vmbreak;
       }
-      case OP_CLOSURE: {
+      vmcase(OP_CLOSURE) {
         Proto *p;
         Closure *ncl;
         int nup, j;
@@ -733,9 +1032,9 @@ void luaV_execute (lua_State *L, int nexeccalls) {
         }
         setclvalue(L, ra, ncl);
         Protect(luaC_checkGC(L));
-        continue;
+        vmbreak;
       }
-      case OP_VARARG: {
+      vmcase(OP_VARARG) {
         int b = GETARG_B(i) - 1;
         int j;
         CallInfo *ci = L->ci;
@@ -754,8 +1053,17 @@ void luaV_execute (lua_State *L, int nexeccalls) {
             setnilvalue(ra + j);
           }
         }
-        continue;
+        vmbreak;
+      }
+#if !LUA_USE_JUMPTABLE
+      default: {  /* hooked variant: run hooks, then the real handler */
+        lua_assert(op >= NUM_OPCODES);
+        vmhook();
+        ra = RA(i);
+        op = GET_OPCODE(i);
+        goto dispatch;
       }
+#endif
     }
   }
 }